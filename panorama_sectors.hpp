@@ -0,0 +1,172 @@
+/*
+*  Helpers for restricting stereo matching on an unwrapped panorama to a set
+*  of angular sectors. Sectors are given in degrees, with 0 degrees at column 0
+*  of the panorama and 360 degrees at its right edge, and may wrap around the
+*  0/360 seam (e.g. -30:30 for the forward sector).
+*
+*  Each sector is matched on its own cyclic strip of the panorama, widened by
+*  a margin so that the prefilter, block window and disparity search are valid
+*  at the sector edges. Everything outside the sectors is marked as invalid,
+*  so the cost of matching scales with the total sector width.
+*
+*  For StereoBM, whose raw result at a pixel depends only on that
+*  neighbourhood, this gives the same disparities as matching the whole
+*  panorama. Its speckle filter removes small connected regions, which a strip
+*  would clip, so callers should match the strips with speckleWindowSize 0 and
+*  run cv::filterSpeckles once on the stitched disparity; a region crossing a
+*  sector edge is then judged only by its part inside the sectors. StereoSGBM
+*  aggregates its costs along paths across the whole image, so within a strip
+*  it is only an approximation, which improves with a wider margin.
+*/
+
+#ifndef PANORAMA_SECTORS_HPP
+#define PANORAMA_SECTORS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <algorithm>
+#include <stdio.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// a span of panorama columns [start, end), where end may exceed the panorama
+// width for a span which wraps around the seam
+struct ColumnSpan
+{
+	int start;
+	int end;
+};
+
+// Parse a comma-separated list of sectors in degrees, e.g. "-30:30,85:95".
+static bool parse_sectors( const char *arg, std::vector<std::pair<double, double> > &sectors )
+{
+	std::stringstream ss( arg );
+	std::string item;
+	while ( getline( ss, item, ',' ) )
+	{
+		double from, to;
+		if ( sscanf( item.c_str(), "%lf:%lf", &from, &to ) != 2 || to <= from || to - from > 360 )
+			return false;
+		sectors.push_back( std::make_pair( from, to ) );
+	}
+	return !sectors.empty();
+}
+
+// Map the sectors onto the columns of a panorama of the given width, merging
+// any that overlap. A span covering the whole panorama is returned if the
+// sectors do.
+static std::vector<ColumnSpan> sectors_to_columns( const std::vector<std::pair<double, double> > &sectors, int cols )
+{
+	std::vector<ColumnSpan> spans;
+	for ( size_t i = 0; i < sectors.size(); i++ )
+	{
+		int start = cvFloor( sectors[i].first * cols / 360.0 );
+		int end = cvCeil( sectors[i].second * cols / 360.0 );
+		int offset = ( (start % cols) + cols ) % cols - start;
+		ColumnSpan span = { start + offset, std::min( end + offset, start + offset + cols ) };
+		spans.push_back( span );
+	}
+
+	std::sort( spans.begin(), spans.end(),
+			   []( const ColumnSpan &a, const ColumnSpan &b ) { return a.start < b.start; } );
+
+	std::vector<ColumnSpan> merged;
+	for ( size_t i = 0; i < spans.size(); i++ )
+	{
+		if ( !merged.empty() && spans[i].start <= merged.back().end )
+			merged.back().end = std::max( merged.back().end, spans[i].end );
+		else
+			merged.push_back( spans[i] );
+	}
+
+	// a span wrapping past the seam may overlap the first span
+	while ( merged.size() > 1 && merged.back().end - cols >= merged.front().start )
+	{
+		merged.back().end = std::max( merged.back().end, merged.front().end + cols );
+		merged.erase( merged.begin() );
+	}
+
+	for ( size_t i = 0; i < merged.size(); i++ )
+	{
+		if ( merged[i].end - merged[i].start >= cols )
+		{
+			ColumnSpan all = { 0, cols };
+			return std::vector<ColumnSpan>( 1, all );
+		}
+	}
+	return merged;
+}
+
+// The columns on either side of a pixel which StereoBM's prefilter reads: one
+// for the x Sobel, half the window for the normalized response.
+static inline int bm_prefilter_radius( const CvStereoBMState *state )
+{
+	return state->preFilterType == CV_STEREO_BM_NORMALIZED_RESPONSE ? state->preFilterSize/2 : 1;
+}
+
+// Copy the columns [start, start+width) of src into dst, wrapping around the
+// panorama seam. start may be negative.
+static void copy_cyclic_columns( const cv::Mat &src, int start, int width, cv::Mat &dst )
+{
+	dst.create( src.rows, width, src.type() );
+	int cols = src.cols;
+	int done = 0;
+	while ( done < width )
+	{
+		int col = ( ( (start + done) % cols ) + cols ) % cols;
+		int n = std::min( width - done, cols - col );
+		src.colRange( col, col + n ).copyTo( dst.colRange( done, done + n ) );
+		done += n;
+	}
+}
+
+// Compute the disparity only within the given column spans. left_margin and
+// right_margin are the extra columns each strip needs on either side of its
+// span; columns outside the spans are set to invalid_value. match is called as
+// match( strip1, strip2, strip_disp ).
+template <typename Matcher>
+void compute_sector_disparity( Matcher match, const cv::Mat &img1, const cv::Mat &img2, cv::Mat &disp,
+							   const std::vector<ColumnSpan> &spans, int left_margin, int right_margin,
+							   double invalid_value )
+{
+	int cols = img1.cols;
+	cv::Mat strip1, strip2, strip_disp;
+	bool first = true;
+
+	for ( size_t i = 0; i < spans.size(); i++ )
+	{
+		int span_width = spans[i].end - spans[i].start;
+		int width = span_width + left_margin + right_margin;
+
+		// the sectors cover the whole panorama, so just match it directly
+		if ( span_width >= cols )
+		{
+			match( img1, img2, disp );
+			return;
+		}
+
+		copy_cyclic_columns( img1, spans[i].start - left_margin, width, strip1 );
+		copy_cyclic_columns( img2, spans[i].start - left_margin, width, strip2 );
+		match( strip1, strip2, strip_disp );
+
+		if ( first )
+		{
+			disp.create( img1.rows, cols, strip_disp.type() );
+			disp.setTo( cv::Scalar::all( invalid_value ) );
+			first = false;
+		}
+
+		// copy the interior of the strip back, wrapping around the seam
+		int done = 0;
+		while ( done < span_width )
+		{
+			int col = ( spans[i].start + done ) % cols;
+			int n = std::min( span_width - done, cols - col );
+			strip_disp.colRange( left_margin + done, left_margin + done + n ).copyTo( disp.colRange( col, col + n ) );
+			done += n;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+*  Reduces a panorama disparity image to a laser-scan style polar range scan:
+*  for each column (bearing) of the panorama, the distance to the nearest
+*  obstacle within one or more horizontal bands of rows.
+*
+*  The range at a pixel is its depth along the bearing of its column, Z/W
+*  from the calibrated reprojection matrix Q if one is available, otherwise
+*  focal_baseline / disparity. A column only reports an obstacle when at
+*  least min_valid pixels in the band have a valid disparity, and the
+*  min_valid-th nearest of these is used as the range so that a single stray
+*  match cannot produce a phantom obstacle. Columns with no return are
+*  reported as +infinity.
+*
+*  Each scan is written as a compact binary record:
+*
+*    RangeScanHeader
+*    for each band: int32 row_start, int32 row_end, float ranges[num_ranges]
+*
+*  with bearings starting at angle_min (radians) for column 0 and increasing by
+*  angle_increment per column.
+*/
+
+#ifndef RANGE_SCAN_HPP
+#define RANGE_SCAN_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct RangeScanHeader
+{
+	char magic[4];            // "RSCN"
+	uint32_t version;
+	uint32_t frame;
+	uint32_t num_bands;
+	uint32_t num_ranges;      // one per panorama column
+	float angle_min;
+	float angle_increment;
+	float max_range;
+	double timestamp;         // seconds
+};
+
+struct RangeScanParams
+{
+	std::vector<std::pair<int, int> > bands;   // [row_start, row_end) of each band
+	double min_disparity;     // disparities (in pixels) at or below this are invalid
+	int min_valid;            // valid pixels required in a column for a return
+	double max_range;         // ranges beyond this are discarded
+	double focal_baseline;    // used when no Q matrix is given
+	double scale_8u;          // pixels per unit of an 8-bit disparity (StereoVar
+	                          // scales its output by 256/(maxDisp-minDisp))
+
+	RangeScanParams() : min_disparity( 0 ), min_valid( 3 ), max_range( 1.0e4 ), focal_baseline( 0 ), scale_8u( 1 ) {}
+};
+
+// Parse a comma-separated list of row bands, e.g. "40:80,100:120".
+static bool parse_scan_bands( const char *arg, std::vector<std::pair<int, int> > &bands )
+{
+	std::stringstream ss( arg );
+	std::string item;
+	while ( getline( ss, item, ',' ) )
+	{
+		int from, to;
+		if ( sscanf( item.c_str(), "%d:%d", &from, &to ) != 2 || from < 0 || to <= from )
+			return false;
+		bands.push_back( std::make_pair( from, to ) );
+	}
+	return !bands.empty();
+}
+
+// the disparity (in pixels) of element x of a row of the given type, where
+// 8-bit disparities are in units of scale_8u pixels
+static inline double scan_disparity_at( const uchar *row, int type, int x, double scale_8u )
+{
+	switch ( type )
+	{
+		case CV_16S: return ((const short*)row)[x] / 16.0;   // StereoBM / StereoSGBM fixed point
+		case CV_32F: return ((const float*)row)[x];
+		default: return row[x] * scale_8u;
+	}
+}
+
+// Compute the range scan of disp, one vector of disp.cols ranges per band,
+// stored band after band in ranges. Q may be empty, in which case
+// params.focal_baseline is used.
+static void compute_range_scan( const cv::Mat &disp, const cv::Mat &Q, const RangeScanParams &params,
+								std::vector<float> &ranges )
+{
+	int cols = disp.cols;
+	int num_bands = params.bands.empty() ? 1 : params.bands.size();
+	ranges.assign( num_bands*cols, INFINITY );
+
+	double q[4][4];
+	bool use_q = !Q.empty();
+	if ( use_q )
+		for ( int i = 0; i < 4; i++ )
+			for ( int j = 0; j < 4; j++ )
+				q[i][j] = Q.at<double>( i, j );
+
+	// the k nearest ranges of each column, kept sorted, reused across bands
+	int k = std::max( params.min_valid, 1 );
+	std::vector<float> nearest( cols*k );
+	std::vector<int> count( cols );
+
+	for ( int b = 0; b < num_bands; b++ )
+	{
+		int row_start = params.bands.empty() ? 0 : std::min( params.bands[b].first, disp.rows );
+		int row_end = params.bands.empty() ? disp.rows : std::min( params.bands[b].second, disp.rows );
+
+		std::fill( count.begin(), count.end(), 0 );
+
+		for ( int y = row_start; y < row_end; y++ )
+		{
+			const uchar *row = disp.ptr( y );
+			for ( int x = 0; x < cols; x++ )
+			{
+				double d = scan_disparity_at( row, disp.depth(), x, params.scale_8u );
+				if ( d <= params.min_disparity )
+					continue;
+
+				double range;
+				// the column gives the bearing, so the range is the depth along
+				// it; Q's X is across a pinhole image, not along the panorama
+				if ( use_q )
+				{
+					double Z = q[2][0]*x + q[2][1]*y + q[2][2]*d + q[2][3];
+					double W = q[3][0]*x + q[3][1]*y + q[3][2]*d + q[3][3];
+					if ( W == 0 )
+						continue;
+					range = fabs( Z / W );
+				}
+				else
+					range = params.focal_baseline / d;
+
+				if ( range > params.max_range )
+					continue;
+
+				// insert into the sorted list of the column's nearest ranges
+				float *best = &nearest[x*k];
+				int n = count[x];
+				if ( n == k && range >= best[k-1] )
+					continue;
+				int pos = n < k ? n : k-1;
+				while ( pos > 0 && best[pos-1] > range )
+				{
+					best[pos] = best[pos-1];
+					pos--;
+				}
+				best[pos] = range;
+				count[x] = std::min( n+1, k );
+			}
+		}
+
+		float *out = &ranges[b*cols];
+		for ( int x = 0; x < cols; x++ )
+		{
+			if ( count[x] == k )
+				out[x] = nearest[x*k + k-1];
+		}
+	}
+}
+
+// Append one scan record to the stream fp.
+static bool write_range_scan( FILE *fp, unsigned int frame, double timestamp, int cols,
+							  const RangeScanParams &params, const std::vector<float> &ranges, int disp_rows )
+{
+	RangeScanHeader header;
+	memcpy( header.magic, "RSCN", 4 );
+	header.version = 1;
+	header.frame = frame;
+	header.num_bands = params.bands.empty() ? 1 : params.bands.size();
+	header.num_ranges = cols;
+	header.angle_min = 0;
+	header.angle_increment = 2*CV_PI / cols;
+	header.max_range = params.max_range;
+	header.timestamp = timestamp;
+
+	if ( fwrite( &header, sizeof(header), 1, fp ) != 1 )
+		return false;
+
+	for ( unsigned int b = 0; b < header.num_bands; b++ )
+	{
+		int32_t band[2] = { 0, disp_rows };
+		if ( !params.bands.empty() )
+		{
+			band[0] = params.bands[b].first;
+			band[1] = params.bands[b].second;
+		}
+		if ( fwrite( band, sizeof(band), 1, fp ) != 1 ||
+			 fwrite( &ranges[b*cols], sizeof(float), cols, fp ) != (size_t)cols )
+			return false;
+	}
+	return true;
+}
+
+// The size in bytes of one scan record.
+static size_t range_scan_record_size( int cols, int num_bands )
+{
+	return sizeof(RangeScanHeader) + num_bands*( 2*sizeof(int32_t) + cols*sizeof(float) );
+}
+
+#endif
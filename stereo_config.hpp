@@ -0,0 +1,151 @@
+/*
+*  A set of stereo matcher parameters for StereoBM, StereoSGBM and StereoVar
+*  which can be saved to and loaded from a configuration file. These are
+*  written by stereo_tune as a list of Pareto-optimal configurations, sorted
+*  from fastest to slowest, and loaded by stereo_match with --config.
+*/
+
+#ifndef STEREO_CONFIG_HPP
+#define STEREO_CONFIG_HPP
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/contrib/contrib.hpp"
+#include <string>
+
+struct StereoParams
+{
+	std::string algorithm;    // bm, sgbm, hh or var
+	int block_size;
+	int num_disparities;
+	int pre_filter_cap;
+	int uniqueness_ratio;
+	int speckle_window_size;
+	int speckle_range;
+	int texture_threshold;    // bm only
+	int disp12_max_diff;
+	int p1, p2;               // sgbm only
+	int var_iterations;       // var only
+	double var_fi, var_lambda;
+
+	// the measured performance of the configuration, if tuned
+	double time_ms;
+	double valid_ratio;
+	double mean_error;
+	double bad_ratio;
+
+	StereoParams() : algorithm( "sgbm" ), block_size( 3 ), num_disparities( 16 ), pre_filter_cap( 63 ),
+					 uniqueness_ratio( 10 ), speckle_window_size( 100 ), speckle_range( 32 ),
+					 texture_threshold( 10 ), disp12_max_diff( 1 ), p1( 8*9 ), p2( 32*9 ),
+					 var_iterations( 25 ), var_fi( 15 ), var_lambda( 0.03 ),
+					 time_ms( 0 ), valid_ratio( 0 ), mean_error( -1 ), bad_ratio( -1 ) {}
+};
+
+// Set up the matcher for params.algorithm with the given parameters. Settings
+// which are not tuned are as in stereo_match.
+static void apply_stereo_params( const StereoParams &params, cv::StereoBM &bm, cv::StereoSGBM &sgbm, cv::StereoVar &var )
+{
+	if ( params.algorithm == "bm" )
+	{
+		bm.state->preFilterCap = params.pre_filter_cap;
+		bm.state->SADWindowSize = params.block_size;
+		bm.state->minDisparity = 0;
+		bm.state->numberOfDisparities = params.num_disparities;
+		bm.state->textureThreshold = params.texture_threshold;
+		bm.state->uniquenessRatio = params.uniqueness_ratio;
+		bm.state->speckleWindowSize = params.speckle_window_size;
+		bm.state->speckleRange = params.speckle_range;
+		bm.state->disp12MaxDiff = params.disp12_max_diff;
+	}
+	else if ( params.algorithm == "var" )
+	{
+		var.levels = 3;
+		var.pyrScale = 0.5;
+		var.nIt = params.var_iterations;
+		var.minDisp = -params.num_disparities;
+		var.maxDisp = 0;
+		var.poly_n = 3;
+		var.poly_sigma = 0.0;
+		var.fi = params.var_fi;
+		var.lambda = params.var_lambda;
+		var.penalization = var.PENALIZATION_TICHONOV;
+		var.cycle = var.CYCLE_V;
+		var.flags = var.USE_SMART_ID | var.USE_AUTO_PARAMS | var.USE_INITIAL_DISPARITY | var.USE_MEDIAN_FILTERING;
+	}
+	else
+	{
+		sgbm.preFilterCap = params.pre_filter_cap;
+		sgbm.SADWindowSize = params.block_size;
+		sgbm.P1 = params.p1;
+		sgbm.P2 = params.p2;
+		sgbm.minDisparity = 0;
+		sgbm.numberOfDisparities = params.num_disparities;
+		sgbm.uniquenessRatio = params.uniqueness_ratio;
+		sgbm.speckleWindowSize = params.speckle_window_size;
+		sgbm.speckleRange = params.speckle_range;
+		sgbm.disp12MaxDiff = params.disp12_max_diff;
+		sgbm.fullDP = params.algorithm == "hh";
+	}
+}
+
+static void write_stereo_params( cv::FileStorage &fs, const StereoParams &params )
+{
+	fs << "{"
+	   << "algorithm" << params.algorithm
+	   << "block_size" << params.block_size
+	   << "num_disparities" << params.num_disparities
+	   << "pre_filter_cap" << params.pre_filter_cap
+	   << "uniqueness_ratio" << params.uniqueness_ratio
+	   << "speckle_window_size" << params.speckle_window_size
+	   << "speckle_range" << params.speckle_range
+	   << "texture_threshold" << params.texture_threshold
+	   << "disp12_max_diff" << params.disp12_max_diff
+	   << "P1" << params.p1
+	   << "P2" << params.p2
+	   << "var_iterations" << params.var_iterations
+	   << "var_fi" << params.var_fi
+	   << "var_lambda" << params.var_lambda
+	   << "time_ms" << params.time_ms
+	   << "valid_ratio" << params.valid_ratio
+	   << "mean_error" << params.mean_error
+	   << "bad_ratio" << params.bad_ratio
+	   << "}";
+}
+
+static void read_stereo_params( const cv::FileNode &node, StereoParams &params )
+{
+	node["algorithm"] >> params.algorithm;
+	node["block_size"] >> params.block_size;
+	node["num_disparities"] >> params.num_disparities;
+	node["pre_filter_cap"] >> params.pre_filter_cap;
+	node["uniqueness_ratio"] >> params.uniqueness_ratio;
+	node["speckle_window_size"] >> params.speckle_window_size;
+	node["speckle_range"] >> params.speckle_range;
+	node["texture_threshold"] >> params.texture_threshold;
+	node["disp12_max_diff"] >> params.disp12_max_diff;
+	node["P1"] >> params.p1;
+	node["P2"] >> params.p2;
+	node["var_iterations"] >> params.var_iterations;
+	node["var_fi"] >> params.var_fi;
+	node["var_lambda"] >> params.var_lambda;
+	node["time_ms"] >> params.time_ms;
+	node["valid_ratio"] >> params.valid_ratio;
+	node["mean_error"] >> params.mean_error;
+	node["bad_ratio"] >> params.bad_ratio;
+}
+
+// Load configuration number index from a file written by stereo_tune.
+static bool load_stereo_config( const char *filename, int index, StereoParams &params )
+{
+	cv::FileStorage fs( filename, CV_STORAGE_READ );
+	if ( !fs.isOpened() )
+		return false;
+
+	cv::FileNode configs = fs["configurations"];
+	if ( !configs.isSeq() || index < 0 || index >= (int)configs.size() )
+		return false;
+
+	read_stereo_params( configs[index], params );
+	return true;
+}
+
+#endif
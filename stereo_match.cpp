@@ -12,7 +12,13 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/contrib/contrib.hpp"
 
+#include "panorama_sectors.hpp"
+#include "range_scan.hpp"
+#include "stereo_config.hpp"
+#include "voxel_map.hpp"
+
 #include <stdio.h>
+#include <sys/time.h>
 
 using namespace cv;
 
@@ -21,7 +27,12 @@ static void print_help()
     printf("\nDemo stereo matching converting L and R images into disparity and point clouds\n");
     printf("\nUsage: stereo_match <left_image> <right_image> [--algorithm=bm|sgbm|hh|var] [--blocksize=<block_size>]\n"
            "[--max-disparity=<max_disparity>] [--scale=scale_factor>] [-i <intrinsic_filename>] [-e <extrinsic_filename>]\n"
-           "[--no-display] [-o <disparity_image>] [-p <point_cloud_file>]\n");
+           "[--no-display] [-o <disparity_image>] [-p <point_cloud_file>]\n"
+           "[--sectors=<from:to,...>] [--sector-margin=<pixels> (default 0 for bm, max-disparity otherwise)]\n"
+           "[-r <range_scan_file>] [--scan-bands=<row:row,...>] [--scan-min-valid=<pixels>] [--scan-max-range=<range>]\n"
+           "[--baseline-focal=<focal_length*baseline>] [--config=<stereo_tune_config> [--config-index=<n>]]\n"
+           "[--voxel-map=<snapshot_file>] [--voxel-size=<size>] [--voxel-max=<count>] [--voxel-range=<distance>] [--voxel-max-age=<frames>]\n"
+           "[--pose=<x,y,z,yaw_degrees>]\n");
 }
 
 static void saveXYZ(const char* filename, const Mat& mat)
@@ -47,6 +58,20 @@ int main(int argc, char** argv)
     const char* blocksize_opt = "--blocksize=";
     const char* nodisplay_opt = "--no-display=";
     const char* scale_opt = "--scale=";
+    const char* sectors_opt = "--sectors=";
+    const char* sector_margin_opt = "--sector-margin=";
+    const char* scan_bands_opt = "--scan-bands=";
+    const char* scan_min_valid_opt = "--scan-min-valid=";
+    const char* scan_max_range_opt = "--scan-max-range=";
+    const char* baseline_focal_opt = "--baseline-focal=";
+    const char* config_opt = "--config=";
+    const char* config_index_opt = "--config-index=";
+    const char* voxel_map_opt = "--voxel-map=";
+    const char* voxel_size_opt = "--voxel-size=";
+    const char* voxel_max_opt = "--voxel-max=";
+    const char* voxel_range_opt = "--voxel-range=";
+    const char* voxel_max_age_opt = "--voxel-max-age=";
+    const char* pose_opt = "--pose=";
 
     if(argc < 3)
     {
@@ -59,12 +84,25 @@ int main(int argc, char** argv)
     const char* extrinsic_filename = 0;
     const char* disparity_filename = 0;
     const char* point_cloud_filename = 0;
+    const char* range_scan_filename = 0;
+    const char* config_filename = 0;
+    int config_index = 0;
+    const char* voxel_map_filename = 0;
+    double voxel_size = 0.05, voxel_range = 0;
+    int voxel_max = 1000000, voxel_max_age = 0;
+    // the camera's position in the voxel map and its yaw (degrees) about its
+    // vertical axis; the default suits a stationary camera
+    Point3f pose_position(0, 0, 0);
+    float pose_yaw = 0;
 
     enum { STEREO_BM=0, STEREO_SGBM=1, STEREO_HH=2, STEREO_VAR=3 };
     int alg = STEREO_SGBM;
     int SADWindowSize = 0, numberOfDisparities = 0;
     bool no_display = false;
     float scale = 1.f;
+    std::vector<std::pair<double, double> > sectors;
+    int sector_margin = -1;
+    RangeScanParams scan_params;
 
     StereoBM bm;
     StereoSGBM sgbm;
@@ -120,6 +158,106 @@ int main(int argc, char** argv)
                 return -1;
             }
         }
+        else if( strncmp(argv[i], sectors_opt, strlen(sectors_opt)) == 0 )
+        {
+            if( !parse_sectors( argv[i] + strlen(sectors_opt), sectors ) )
+            {
+                printf("Command-line parameter error: The sectors (--sectors=<...>) must be a comma-separated list of <from:to> angles in degrees\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], sector_margin_opt, strlen(sector_margin_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(sector_margin_opt), "%d", &sector_margin ) != 1 || sector_margin < 0 )
+            {
+                printf("Command-line parameter error: The sector margin (--sector-margin=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], scan_bands_opt, strlen(scan_bands_opt)) == 0 )
+        {
+            if( !parse_scan_bands( argv[i] + strlen(scan_bands_opt), scan_params.bands ) )
+            {
+                printf("Command-line parameter error: The scan bands (--scan-bands=<...>) must be a comma-separated list of <from:to> rows\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], scan_min_valid_opt, strlen(scan_min_valid_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(scan_min_valid_opt), "%d", &scan_params.min_valid ) != 1 || scan_params.min_valid < 1 )
+            {
+                printf("Command-line parameter error: The minimum valid pixels (--scan-min-valid=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], scan_max_range_opt, strlen(scan_max_range_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(scan_max_range_opt), "%lf", &scan_params.max_range ) != 1 || scan_params.max_range <= 0 )
+            {
+                printf("Command-line parameter error: The maximum range (--scan-max-range=<...>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], baseline_focal_opt, strlen(baseline_focal_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(baseline_focal_opt), "%lf", &scan_params.focal_baseline ) != 1 || scan_params.focal_baseline <= 0 )
+            {
+                printf("Command-line parameter error: The focal length times baseline (--baseline-focal=<...>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], config_opt, strlen(config_opt)) == 0 )
+            config_filename = argv[i] + strlen(config_opt);
+        else if( strncmp(argv[i], config_index_opt, strlen(config_index_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(config_index_opt), "%d", &config_index ) != 1 || config_index < 0 )
+            {
+                printf("Command-line parameter error: The configuration index (--config-index=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], voxel_map_opt, strlen(voxel_map_opt)) == 0 )
+            voxel_map_filename = argv[i] + strlen(voxel_map_opt);
+        else if( strncmp(argv[i], voxel_size_opt, strlen(voxel_size_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(voxel_size_opt), "%lf", &voxel_size ) != 1 || voxel_size <= 0 )
+            {
+                printf("Command-line parameter error: The voxel size (--voxel-size=<...>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], voxel_max_opt, strlen(voxel_max_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(voxel_max_opt), "%d", &voxel_max ) != 1 || voxel_max < 1 )
+            {
+                printf("Command-line parameter error: The maximum number of voxels (--voxel-max=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], voxel_range_opt, strlen(voxel_range_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(voxel_range_opt), "%lf", &voxel_range ) != 1 || voxel_range < 0 )
+            {
+                printf("Command-line parameter error: The voxel range (--voxel-range=<...>) must be a non-negative number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], voxel_max_age_opt, strlen(voxel_max_age_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(voxel_max_age_opt), "%d", &voxel_max_age ) != 1 || voxel_max_age < 0 )
+            {
+                printf("Command-line parameter error: The maximum voxel age (--voxel-max-age=<...>) must be a non-negative integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], pose_opt, strlen(pose_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(pose_opt), "%f,%f,%f,%f", &pose_position.x, &pose_position.y, &pose_position.z, &pose_yaw ) != 4 )
+            {
+                printf("Command-line parameter error: The pose (--pose=<...>) must be given as x,y,z,yaw\n");
+                return -1;
+            }
+        }
         else if( strcmp(argv[i], nodisplay_opt) == 0 )
             no_display = true;
         else if( strcmp(argv[i], "-i" ) == 0 )
@@ -130,6 +268,8 @@ int main(int argc, char** argv)
             disparity_filename = argv[++i];
         else if( strcmp(argv[i], "-p" ) == 0 )
             point_cloud_filename = argv[++i];
+        else if( strcmp(argv[i], "-r" ) == 0 )
+            range_scan_filename = argv[++i];
         else
         {
             printf("Command-line parameter error: unknown option %s\n", argv[i]);
@@ -137,6 +277,24 @@ int main(int argc, char** argv)
         }
     }
 
+    // a tuned configuration overrides the algorithm and matcher settings
+    StereoParams config;
+    if( config_filename )
+    {
+        if( !load_stereo_config(config_filename, config_index, config) )
+        {
+            printf("Failed to load configuration %d from %s\n", config_index, config_filename);
+            return -1;
+        }
+        alg = config.algorithm == "bm" ? STEREO_BM :
+              config.algorithm == "hh" ? STEREO_HH :
+              config.algorithm == "var" ? STEREO_VAR : STEREO_SGBM;
+        SADWindowSize = config.block_size;
+        numberOfDisparities = config.num_disparities;
+        printf("Using %s configuration %d from %s (tuned at %.2fms per pair)\n",
+               config.algorithm.c_str(), config_index, config_filename, config.time_ms);
+    }
+
     if( !img1_filename || !img2_filename )
     {
         printf("Command-line parameter error: both left and right images must be specified\n");
@@ -149,13 +307,21 @@ int main(int argc, char** argv)
         return -1;
     }
 
-    if( extrinsic_filename == 0 && point_cloud_filename )
+    if( extrinsic_filename == 0 && (point_cloud_filename || voxel_map_filename) )
     {
         printf("Command-line parameter error: extrinsic and intrinsic parameters must be specified to compute the point cloud\n");
         return -1;
     }
 
-    int color_mode = alg == STEREO_BM ? 0 : -1;
+    if( extrinsic_filename == 0 && range_scan_filename && scan_params.focal_baseline <= 0 )
+    {
+        printf("Command-line parameter error: either the extrinsic and intrinsic parameters or --baseline-focal must be specified to compute the range scan\n");
+        return -1;
+    }
+
+    // a tuned configuration was measured on greyscale pairs (its P1 and P2
+    // assume one channel), so match in greyscale when one is loaded
+    int color_mode = alg == STEREO_BM || config_filename ? 0 : -1;
     Mat img1 = imread(img1_filename, color_mode);
     Mat img2 = imread(img2_filename, color_mode);
 
@@ -260,19 +426,71 @@ int main(int argc, char** argv)
     var.cycle = var.CYCLE_V;                        // ignored with USE_AUTO_PARAMS
     var.flags = var.USE_SMART_ID | var.USE_AUTO_PARAMS | var.USE_INITIAL_DISPARITY | var.USE_MEDIAN_FILTERING ;
 
+    if( config_filename )
+        apply_stereo_params(config, bm, sgbm, var);
+
     Mat disp, disp8;
     //Mat img1p, img2p, dispp;
     //copyMakeBorder(img1, img1p, 0, 0, numberOfDisparities, 0, IPL_BORDER_REPLICATE);
     //copyMakeBorder(img2, img2p, 0, 0, numberOfDisparities, 0, IPL_BORDER_REPLICATE);
 
+    std::vector<ColumnSpan> spans;
+    if( !sectors.empty() )
+    {
+        spans = sectors_to_columns(sectors, img_size.width);
+        int matched = 0;
+        for( size_t i = 0; i < spans.size(); i++ )
+            matched += spans[i].end - spans[i].start;
+        printf("Matching %d of %d panorama columns in %d sector(s)\n", matched, img_size.width, (int)spans.size());
+
+        // the rectification ROIs refer to the full images, not the sector strips
+        bm.state->roi1 = bm.state->roi2 = Rect();
+    }
+
+    // runs the selected matcher on a pair of (possibly cropped) images
+    auto match = [&]( const Mat& left, const Mat& right, Mat& out )
+    {
+        if( alg == STEREO_BM )
+            bm(left, right, out);
+        else if( alg == STEREO_VAR ) {
+            var(left, right, out);
+        }
+        else if( alg == STEREO_SGBM || alg == STEREO_HH )
+            sgbm(left, right, out);
+    };
+
     int64 t = getTickCount();
-    if( alg == STEREO_BM )
-        bm(img1, img2, disp);
-    else if( alg == STEREO_VAR ) {
-        var(img1, img2, disp);
+    if( spans.empty() )
+        match(img1, img2, disp);
+    else
+    {
+        // the strips need the prefilter and half a block on either side, plus
+        // the disparity search range to the left of each sector. That is
+        // exact for BM before speckle filtering; SGBM (and HH and var)
+        // aggregate over the whole image, so by default they get a further
+        // margin of the disparity range, which only approximates matching
+        // the whole panorama.
+        int half_window = alg == STEREO_BM ? bm_prefilter_radius(bm.state) + bm.state->SADWindowSize/2 :
+                          1 + sgbm.SADWindowSize/2;
+        if( sector_margin < 0 )
+            sector_margin = alg == STEREO_BM ? 0 : numberOfDisparities;
+        int left_margin = numberOfDisparities + half_window + sector_margin;
+        int right_margin = half_window + sector_margin;
+        double invalid = alg == STEREO_VAR ? 0 :
+                         ((alg == STEREO_BM ? bm.state->minDisparity : sgbm.minDisparity) - 1)*16;
+        // speckle regions are connected components that a strip would clip,
+        // so the strips are matched unfiltered and the stitched disparity is
+        // filtered once
+        int speckle_window = alg == STEREO_BM ? bm.state->speckleWindowSize : sgbm.speckleWindowSize;
+        int speckle_range = alg == STEREO_BM ? bm.state->speckleRange : sgbm.speckleRange;
+        bm.state->speckleWindowSize = 0;
+        sgbm.speckleWindowSize = 0;
+        compute_sector_disparity(match, img1, img2, disp, spans, left_margin, right_margin, invalid);
+        if( alg != STEREO_VAR && speckle_window > 0 )
+            filterSpeckles(disp, invalid, speckle_window, speckle_range);
+        bm.state->speckleWindowSize = speckle_window;
+        sgbm.speckleWindowSize = speckle_window;
     }
-    else if( alg == STEREO_SGBM || alg == STEREO_HH )
-        sgbm(img1, img2, disp);
     t = getTickCount() - t;
     printf("Time elapsed: %fms\n", t*1000/getTickFrequency());
 
@@ -298,15 +516,90 @@ int main(int argc, char** argv)
     if(disparity_filename)
         imwrite(disparity_filename, disp8);
 
+    if(range_scan_filename)
+    {
+        // reduce the disparity to one range per column and append it to the
+        // scan stream, numbering the scans by their position in the stream
+        std::vector<float> ranges;
+        int64 scan_t = getTickCount();
+        if( alg == STEREO_VAR )
+            scan_params.scale_8u = (var.maxDisp - var.minDisp)/256.;
+        compute_range_scan(disp, extrinsic_filename ? Q : Mat(), scan_params, ranges);
+        scan_t = getTickCount() - scan_t;
+
+        FILE* fp = fopen(range_scan_filename, "ab");
+        if( !fp )
+        {
+            printf("Failed to open file %s\n", range_scan_filename);
+            return -1;
+        }
+        fseek(fp, 0, SEEK_END);
+        int num_bands = scan_params.bands.empty() ? 1 : scan_params.bands.size();
+        unsigned int frame = ftell(fp) / range_scan_record_size(disp.cols, num_bands);
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        bool ok = write_range_scan(fp, frame, now.tv_sec + now.tv_usec*1e-6, disp.cols, scan_params, ranges, disp.rows);
+        fclose(fp);
+        if( !ok )
+        {
+            printf("Failed to write the range scan to %s\n", range_scan_filename);
+            return -1;
+        }
+        printf("Range scan %u (%d bands x %d bearings) computed in %fms\n", frame, num_bands, disp.cols, scan_t*1000/getTickFrequency());
+    }
+
+    Mat xyz;
+    if(point_cloud_filename || voxel_map_filename)
+    {
+        // reprojectImageTo3D takes the disparity as it is, so convert it to
+        // pixels first: BM and SGBM give 16ths of a pixel, var 8 bits scaled
+        // by 256/(maxDisp-minDisp)
+        Mat fdisp;
+        if( alg != STEREO_VAR )
+            disp.convertTo(fdisp, CV_32F, 1./16);
+        else
+            disp.convertTo(fdisp, CV_32F, (var.maxDisp - var.minDisp)/256.);
+        reprojectImageTo3D(fdisp, xyz, Q, true);
+    }
+
     if(point_cloud_filename)
     {
         printf("storing the point cloud...");
         fflush(stdout);
-        Mat xyz;
-        reprojectImageTo3D(disp, xyz, Q, true);
         saveXYZ(point_cloud_filename, xyz);
         printf("\n");
     }
 
+    if(voxel_map_filename)
+    {
+        // accumulate this frame into the map snapshot, starting a new map if
+        // there is none yet, placing its points by the camera's pose
+        VoxelMap voxels(voxel_size, voxel_max, voxel_range, voxel_max_age);
+        FILE* existing = fopen(voxel_map_filename, "rb");
+        if( existing )
+        {
+            fclose(existing);
+            if( !voxels.load(voxel_map_filename) )
+            {
+                printf("Failed to load the voxel map %s (bad file or different --voxel-size)\n", voxel_map_filename);
+                return -1;
+            }
+        }
+        else
+            printf("Starting a new voxel map in %s\n", voxel_map_filename);
+
+        int64 voxel_t = getTickCount();
+        size_t inserted = voxels.insert_frame(xyz, pose_position, pose_yaw*CV_PI/180);
+        voxel_t = getTickCount() - voxel_t;
+
+        if( !voxels.save(voxel_map_filename) )
+        {
+            printf("Failed to write the voxel map to %s\n", voxel_map_filename);
+            return -1;
+        }
+        printf("Inserted %d points into the voxel map in %fms: %d voxels after %u frames\n",
+               (int)inserted, voxel_t*1000/getTickFrequency(), (int)voxels.size(), voxels.frames());
+    }
+
     return 0;
 }
@@ -0,0 +1,453 @@
+/*
+*  Sweeps the StereoBM, StereoSGBM and StereoVar parameters used by
+*  stereo_match over a directory of stereo pairs, measuring the runtime and
+*  disparity quality of each configuration, and writes the Pareto-optimal
+*  configurations (fastest first) to a file which stereo_match can load with
+*  --config.
+*
+*  Pairs are found as top_<name> / bottom_<name>, as saved by undistort. If a
+*  reference directory is given, <reference_dir>/<name> is read as the
+*  reference disparity: each value times --reference-scale is the disparity in
+*  pixels, and 0 marks unknown pixels.
+*/
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/contrib/contrib.hpp"
+
+#include "stereo_config.hpp"
+
+#include <dirent.h>
+#include <float.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace cv;
+
+struct StereoPair
+{
+    std::string name;
+    Mat left, right, reference;
+};
+
+static void print_help()
+{
+    printf("\nStereo parameter autotuner producing a speed/quality Pareto front\n");
+    printf("\nUsage: stereo_tune <pair_dir> [--reference-dir=<dir>] [--reference-scale=<scale>] [--algorithms=bm,sgbm,hh,var]\n"
+           "[--max-disparity=<max_disparity>] [--threads=<n>] [--repeats=<n>] [--transpose] [-o <config_file>]\n");
+}
+
+// Find the top_<name> / bottom_<name> pairs in dir, sorted by name.
+static std::vector<std::string> find_pairs(const std::string& dir)
+{
+    std::vector<std::string> names;
+    DIR* d = opendir(dir.c_str());
+    if( !d )
+        return names;
+
+    struct dirent* entry;
+    while( (entry = readdir(d)) != 0 )
+    {
+        std::string file = entry->d_name;
+        if( file.compare(0, 4, "top_") != 0 )
+            continue;
+        std::string name = file.substr(4);
+        FILE* fp = fopen((dir + "/bottom_" + name).c_str(), "rb");
+        if( fp )
+        {
+            fclose(fp);
+            names.push_back(name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+// The parameter grid swept for each algorithm.
+static void build_grid(const std::vector<std::string>& algorithms, int max_disparity, std::vector<StereoParams>& grid)
+{
+    const int disparities[] = { 16, 32, 48, 64, 96, 128 };
+
+    for( size_t a = 0; a < algorithms.size(); a++ )
+    {
+        const std::string& alg = algorithms[a];
+        for( int di = 0; di < 6; di++ )
+        {
+            int nd = disparities[di];
+            if( nd > max_disparity )
+                break;
+
+            StereoParams p;
+            p.algorithm = alg;
+            p.num_disparities = nd;
+
+            if( alg == "bm" )
+            {
+                const int blocks[] = { 5, 9, 15, 21 }, caps[] = { 15, 31, 63 }, uniqueness[] = { 5, 15 }, speckles[] = { 0, 100 };
+                for( int b = 0; b < 4; b++ )
+                for( int c = 0; c < 3; c++ )
+                for( int u = 0; u < 2; u++ )
+                for( int s = 0; s < 2; s++ )
+                {
+                    p.block_size = blocks[b];
+                    p.pre_filter_cap = caps[c];
+                    p.uniqueness_ratio = uniqueness[u];
+                    p.speckle_window_size = speckles[s];
+                    grid.push_back(p);
+                }
+            }
+            else if( alg == "var" )
+            {
+                const int iterations[] = { 10, 25, 50 };
+                const double fis[] = { 5, 15, 25 }, lambdas[] = { 0.01, 0.03, 0.1 };
+                for( int n = 0; n < 3; n++ )
+                for( int f = 0; f < 3; f++ )
+                for( int l = 0; l < 3; l++ )
+                {
+                    p.var_iterations = iterations[n];
+                    p.var_fi = fis[f];
+                    p.var_lambda = lambdas[l];
+                    grid.push_back(p);
+                }
+            }
+            else
+            {
+                const int blocks[] = { 3, 5, 7 }, uniqueness[] = { 5, 10 }, speckles[] = { 0, 100 };
+                const int p1s[] = { 4, 8, 8 }, p2s[] = { 16, 32, 64 };
+                for( int b = 0; b < 3; b++ )
+                for( int k = 0; k < 3; k++ )
+                for( int u = 0; u < 2; u++ )
+                for( int s = 0; s < 2; s++ )
+                {
+                    // the pairs are matched in greyscale, so cn = 1
+                    p.block_size = blocks[b];
+                    p.p1 = p1s[k]*p.block_size*p.block_size;
+                    p.p2 = p2s[k]*p.block_size*p.block_size;
+                    p.uniqueness_ratio = uniqueness[u];
+                    p.speckle_window_size = speckles[s];
+                    grid.push_back(p);
+                }
+            }
+        }
+    }
+}
+
+// Run one configuration over all of the pairs, filling in its measurements.
+static void evaluate(StereoParams& p, const std::vector<StereoPair>& pairs, int repeats, double reference_scale)
+{
+    StereoBM bm;
+    StereoSGBM sgbm;
+    StereoVar var;
+    apply_stereo_params(p, bm, sgbm, var);
+
+    double total_time = 0, error_sum = 0;
+    long valid = 0, total = 0, compared = 0, reference_valid = 0, bad = 0;
+    Mat disp;
+
+    for( size_t i = 0; i < pairs.size(); i++ )
+    {
+        // keep the fastest of the repeats to reduce scheduling noise
+        double best = 0;
+        for( int r = 0; r < repeats; r++ )
+        {
+            int64 t = getTickCount();
+            if( p.algorithm == "bm" )
+                bm(pairs[i].left, pairs[i].right, disp);
+            else if( p.algorithm == "var" )
+                var(pairs[i].left, pairs[i].right, disp);
+            else
+                sgbm(pairs[i].left, pairs[i].right, disp);
+            t = getTickCount() - t;
+            double ms = t*1000/getTickFrequency();
+            best = r == 0 ? ms : std::min(best, ms);
+        }
+        total_time += best;
+
+        // BM and SGBM give 16ths of a pixel; StereoVar gives 8 bits scaled by
+        // 256/(maxDisp-minDisp)
+        Mat d;
+        if( disp.depth() == CV_16S )
+            disp.convertTo(d, CV_32F, 1/16.);
+        else
+            disp.convertTo(d, CV_32F, (var.maxDisp - var.minDisp)/256.);
+
+        const Mat& ref = pairs[i].reference;
+        for( int y = 0; y < d.rows; y++ )
+        {
+            const float* drow = d.ptr<float>(y);
+            const float* rrow = ref.empty() ? 0 : ref.ptr<float>(y);
+            for( int x = 0; x < d.cols; x++ )
+            {
+                bool ok = drow[x] > 0;
+                valid += ok;
+                total++;
+                if( !rrow || rrow[x] <= 0 )
+                    continue;
+
+                reference_valid++;
+                float err = ok ? fabs(drow[x] - rrow[x]*reference_scale) : 0;
+                if( ok )
+                {
+                    error_sum += err;
+                    compared++;
+                }
+                if( !ok || err > 1 )
+                    bad++;
+            }
+        }
+    }
+
+    p.time_ms = total_time / pairs.size();
+    p.valid_ratio = total ? (double)valid / total : 0;
+    p.mean_error = compared ? error_sum / compared : -1;
+    p.bad_ratio = reference_valid ? (double)bad / reference_valid : -1;
+}
+
+// the mean error, treating a configuration with no valid matches as worst
+static double error_of(const StereoParams& p)
+{
+    return p.mean_error < 0 ? DBL_MAX : p.mean_error;
+}
+
+// true if a is at least as good as b in every objective and better in one
+static bool dominates(const StereoParams& a, const StereoParams& b, bool use_reference)
+{
+    if( use_reference )
+    {
+        bool no_worse = a.time_ms <= b.time_ms && a.bad_ratio <= b.bad_ratio && error_of(a) <= error_of(b);
+        bool better = a.time_ms < b.time_ms || a.bad_ratio < b.bad_ratio || error_of(a) < error_of(b);
+        return no_worse && better;
+    }
+    return a.time_ms <= b.time_ms && a.valid_ratio >= b.valid_ratio &&
+           (a.time_ms < b.time_ms || a.valid_ratio > b.valid_ratio);
+}
+
+static bool faster(const StereoParams& a, const StereoParams& b)
+{
+    return a.time_ms < b.time_ms;
+}
+
+int main(int argc, char** argv)
+{
+    const char* reference_dir_opt = "--reference-dir=";
+    const char* reference_scale_opt = "--reference-scale=";
+    const char* algorithms_opt = "--algorithms=";
+    const char* maxdisp_opt = "--max-disparity=";
+    const char* threads_opt = "--threads=";
+    const char* repeats_opt = "--repeats=";
+
+    if( argc < 2 )
+    {
+        print_help();
+        return 0;
+    }
+
+    const char* pair_dir = 0;
+    const char* reference_dir = 0;
+    const char* output_filename = "stereo_config.yml";
+    double reference_scale = 1;
+    std::vector<std::string> algorithms;
+    int max_disparity = 64;
+    int num_threads = getNumberOfCPUs();
+    int repeats = 1;
+    bool transpose_pairs = false;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( argv[i][0] != '-' )
+            pair_dir = argv[i];
+        else if( strncmp(argv[i], reference_dir_opt, strlen(reference_dir_opt)) == 0 )
+            reference_dir = argv[i] + strlen(reference_dir_opt);
+        else if( strncmp(argv[i], reference_scale_opt, strlen(reference_scale_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(reference_scale_opt), "%lf", &reference_scale ) != 1 || reference_scale <= 0 )
+            {
+                printf("Command-line parameter error: The reference scale (--reference-scale=<...>) must be a positive number\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], algorithms_opt, strlen(algorithms_opt)) == 0 )
+        {
+            std::stringstream ss(argv[i] + strlen(algorithms_opt));
+            std::string alg;
+            while( getline(ss, alg, ',') )
+            {
+                if( alg != "bm" && alg != "sgbm" && alg != "hh" && alg != "var" )
+                {
+                    printf("Command-line parameter error: Unknown stereo algorithm %s\n\n", alg.c_str());
+                    print_help();
+                    return -1;
+                }
+                algorithms.push_back(alg);
+            }
+        }
+        else if( strncmp(argv[i], maxdisp_opt, strlen(maxdisp_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(maxdisp_opt), "%d", &max_disparity ) != 1 || max_disparity < 16 )
+            {
+                printf("Command-line parameter error: The max disparity (--max-disparity=<...>) must be at least 16\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], threads_opt, strlen(threads_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(threads_opt), "%d", &num_threads ) != 1 || num_threads < 1 )
+            {
+                printf("Command-line parameter error: The number of threads (--threads=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strncmp(argv[i], repeats_opt, strlen(repeats_opt)) == 0 )
+        {
+            if( sscanf( argv[i] + strlen(repeats_opt), "%d", &repeats ) != 1 || repeats < 1 )
+            {
+                printf("Command-line parameter error: The number of repeats (--repeats=<...>) must be a positive integer\n");
+                return -1;
+            }
+        }
+        else if( strcmp(argv[i], "--transpose") == 0 )
+            transpose_pairs = true;
+        else if( strcmp(argv[i], "-o") == 0 && i+1 < argc )
+            output_filename = argv[++i];
+        else
+        {
+            printf("Command-line parameter error: unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if( !pair_dir )
+    {
+        printf("Command-line parameter error: the directory of stereo pairs must be specified\n");
+        return -1;
+    }
+    if( algorithms.empty() )
+    {
+        algorithms.push_back("bm");
+        algorithms.push_back("sgbm");
+        algorithms.push_back("var");
+    }
+
+    // load all of the pairs up front, shared read-only between the workers
+    std::vector<std::string> names = find_pairs(pair_dir);
+    std::vector<StereoPair> pairs;
+    for( size_t i = 0; i < names.size(); i++ )
+    {
+        StereoPair pair;
+        pair.name = names[i];
+        pair.left = imread(std::string(pair_dir) + "/top_" + names[i], 0);
+        pair.right = imread(std::string(pair_dir) + "/bottom_" + names[i], 0);
+        if( !pair.left.data || !pair.right.data || pair.left.size() != pair.right.size() )
+        {
+            printf("Skipping unreadable pair %s\n", names[i].c_str());
+            continue;
+        }
+        if( reference_dir )
+        {
+            Mat ref = imread(std::string(reference_dir) + "/" + names[i], -1);
+            if( !ref.data || ref.size() != pair.left.size() )
+            {
+                printf("Skipping pair %s without a matching reference disparity\n", names[i].c_str());
+                continue;
+            }
+            ref.convertTo(pair.reference, CV_32F);
+        }
+        if( transpose_pairs )
+        {
+            // the top/bottom pairs have vertical disparity
+            Mat t1, t2, t3;
+            transpose(pair.left, t1);
+            transpose(pair.right, t2);
+            pair.left = t1;
+            pair.right = t2;
+            if( !pair.reference.empty() )
+            {
+                transpose(pair.reference, t3);
+                pair.reference = t3;
+            }
+        }
+        pairs.push_back(pair);
+    }
+
+    if( pairs.empty() )
+    {
+        printf("No stereo pairs (top_<name> / bottom_<name>) found in %s\n", pair_dir);
+        return -1;
+    }
+
+    std::vector<StereoParams> grid;
+    build_grid(algorithms, std::min(max_disparity, pairs[0].left.cols), grid);
+    printf("Evaluating %d configurations on %d pairs using %d threads...\n",
+           (int)grid.size(), (int)pairs.size(), num_threads);
+
+    // each worker keeps its own matchers and takes the next configuration
+    // until the grid is exhausted; the matchers themselves run single-threaded
+    // so that the configurations do not compete for cores
+    setNumThreads(1);
+    std::atomic<int> next(0), done(0);
+    std::vector<std::thread> workers;
+    int64 t = getTickCount();
+    for( int w = 0; w < num_threads; w++ )
+    {
+        workers.push_back(std::thread([&]()
+        {
+            int i;
+            while( (i = next++) < (int)grid.size() )
+            {
+                evaluate(grid[i], pairs, repeats, reference_scale);
+                int n = ++done;
+                if( n % 20 == 0 )
+                {
+                    printf("  %d / %d\n", n, (int)grid.size());
+                    fflush(stdout);
+                }
+            }
+        }));
+    }
+    for( size_t w = 0; w < workers.size(); w++ )
+        workers[w].join();
+    t = getTickCount() - t;
+    printf("Sweep took %fs\n", t/getTickFrequency());
+
+    // keep only the non-dominated configurations
+    bool use_reference = !pairs[0].reference.empty();
+    std::vector<StereoParams> front;
+    for( size_t i = 0; i < grid.size(); i++ )
+    {
+        bool dominated = false;
+        for( size_t j = 0; j < grid.size() && !dominated; j++ )
+            dominated = j != i && dominates(grid[j], grid[i], use_reference);
+        if( !dominated )
+            front.push_back(grid[i]);
+    }
+    std::sort(front.begin(), front.end(), faster);
+
+    FileStorage fs(output_filename, CV_STORAGE_WRITE);
+    if( !fs.isOpened() )
+    {
+        printf("Failed to open file %s\n", output_filename);
+        return -1;
+    }
+    fs << "configurations" << "[";
+    printf("\n index  algorithm  block  disparities   time(ms)  valid  mean_err  bad\n");
+    for( size_t i = 0; i < front.size(); i++ )
+    {
+        const StereoParams& p = front[i];
+        printf(" %5d  %9s  %5d  %11d  %9.2f  %5.3f  %8.3f  %5.3f\n", (int)i, p.algorithm.c_str(), p.block_size,
+               p.num_disparities, p.time_ms, p.valid_ratio, p.mean_error, p.bad_ratio);
+        write_stereo_params(fs, p);
+    }
+    fs << "]";
+    fs.release();
+
+    printf("\nWrote %d Pareto-optimal configurations to %s\n", (int)front.size(), output_filename);
+    printf("Load one with: stereo_match <left> <right> --config=%s --config-index=<index>\n", output_filename);
+    return 0;
+}
@@ -9,6 +9,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/contrib/contrib.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
+#include "panorama_sectors.hpp"
 #include <stdio.h>
 #include <iostream>
 #include <sys/time.h>
@@ -28,18 +29,33 @@ int get_time_diff( struct timeval *result, struct timeval *t1, struct timeval *t
 int main( int argc, char** argv )
 {
 	bool save = false;	
+	std::vector<std::pair<double, double> > sectors;
 	
 	if ( argc < 3 ) 
     {
-        std::cout<< "Usage: "<<argv[0]<<" <top image> <bottom image> [optional: -save]" << std::endl;
+        std::cout<< "Usage: "<<argv[0]<<" <top image> <bottom image> [optional: -save -sectors <from:to,...>]" << std::endl;
         return -1;
     }
     
-    if ( argc > 3 )
+    for ( int i = 3; i < argc; i++ )
     {
 	    // Check for the "save image flag"
-    	if ( strcmp( "-s", argv[3] ) == 0 || strcmp( "-save", argv[3] ) == 0 )
+    	if ( strcmp( "-s", argv[i] ) == 0 || strcmp( "-save", argv[i] ) == 0 )
     		save = true; 
+    	// and for the angular sectors (in degrees) to restrict matching to
+    	else if ( ( strcmp( "-sectors", argv[i] ) == 0 ) && i+1 < argc )
+    	{
+    		if ( !parse_sectors( argv[++i], sectors ) )
+    		{
+    			std::cout<<"Invalid sectors \""<<argv[i]<<"\" specified, exiting."<<std::endl;
+    			return -1;
+    		}
+    	}
+    	else
+    	{
+    		std::cout<<"Invalid option \""<<argv[i]<<"\" specified, exiting."<<std::endl;
+    		return -1;
+    	}
     } 
     
     cv::Mat top_img = cv::imread( argv[1], 0 );
@@ -55,8 +71,19 @@ int main( int argc, char** argv )
 	gettimeofday(&start_time, NULL);
 	
 	cv::Mat disparity, disp8;
-	cv::StereoBM bm_state = cv::StereoBM(CV_STEREO_BM_BASIC, 32, 5);
-	bm_state( top_img, bottom_img, disparity );
+	const int num_disparities = 32, block_size = 5;
+	cv::StereoBM bm_state = cv::StereoBM(CV_STEREO_BM_BASIC, num_disparities, block_size);
+	if ( sectors.empty() )
+		bm_state( top_img, bottom_img, disparity );
+	else
+	{
+		std::vector<ColumnSpan> spans = sectors_to_columns( sectors, top_img.cols );
+		// each strip needs the prefilter and half a block on either side, plus
+		// the disparity search range to the left
+		int half_window = bm_prefilter_radius( bm_state.state ) + block_size/2;
+		compute_sector_disparity( bm_state, top_img, bottom_img, disparity, spans,
+								  num_disparities + half_window, half_window, -16 );
+	}
 	disparity.convertTo( disp8, CV_8U );
 	imshow( "Disparity", disp8 );
 				
@@ -4,6 +4,9 @@
 *
 *  This is to be used for tracking of people and navigation of a robot. 
 *
+*  The mirror geometry is shared with unwrap_video (video_unwrap/
+*  mirror_geometry.hpp), and can be loaded from a file with -geometry.
+*
 *  Ben Selby, 2013 
 */
 
@@ -13,16 +16,12 @@
 #include <iostream>
 #include <stdio.h>
 #include <sys/time.h>
+#include <string.h>
 #include <string>
+#include <vector>
 
-#define PI 3.141592654
-
-// define the image parameters for cropping the mirror - should be a square
-const int OFFSET_X = 96;
-const int OFFSET_Y = 8;
-const int WIDTH = 465;
-const int HEIGHT = WIDTH;
-const int RADIUS = WIDTH/2;
+#include "video_unwrap/mirror_config.hpp"
+#include "video_unwrap/polar_maps.hpp"
 
 // specify input and output locations:
 const std::string output_path = "output/";
@@ -40,24 +39,42 @@ int get_time_diff( struct timeval *result, struct timeval *t1, struct timeval *t
 int main( int argc, char** argv )
 {
 	int CENTRE_X, CENTRE_Y;
+	MirrorGeometry geometry;
+	std::vector<char*> centre_args;
 
 	if ( argc < 2 ) 
     {
-        printf( "Usage: %s <image_filename> [centre_x centre_y]\n", argv[0] );
+        printf( "Usage: %s <image_filename> [centre_x centre_y] [-geometry <file.yml>]\n", argv[0] );
         return -1;
     }
+
+	for ( int i = 2; i < argc; i++ )
+	{
+		if ( strcmp( "-geometry", argv[i] ) == 0 && i+1 < argc )
+		{
+			if ( !load_mirror_geometry( argv[i+1], geometry ) )
+			{
+				printf( "Unable to load the mirror geometry from \"%s\", exiting.\n", argv[i+1] );
+				return -1;
+			}
+			i++;
+		}
+		else
+			centre_args.push_back( argv[i] );
+	}
+	int radius = geometry.radius();
 	
-	if ( argc == 4 )
+	if ( centre_args.size() == 2 )
 	{
-		CENTRE_X = atoi( argv[2] ) - OFFSET_X;
-		CENTRE_Y = atoi( argv[3] ) - OFFSET_Y;
+		CENTRE_X = atoi( centre_args[0] ) - geometry.offset_x;
+		CENTRE_Y = atoi( centre_args[1] ) - geometry.offset_y;
 		std::cout << "Using specified point [" << CENTRE_X <<", " << 
 		CENTRE_Y << "] as centre of image" << std::endl;
 	}
 	else
 	{
-		CENTRE_X = RADIUS;
-		CENTRE_Y = RADIUS;		
+		CENTRE_X = radius;
+		CENTRE_Y = radius;		
 	}
 	
 	cv::Mat src, cropped_img, unwrapped_img;
@@ -78,28 +95,14 @@ int main( int argc, char** argv )
 	// Crop the input image to contain only the mirror
 	struct CvSize src_size;
 	src_size = src.size();	
-	cv::Rect ROI( OFFSET_X, OFFSET_Y, WIDTH, HEIGHT );
+	cv::Rect ROI( geometry.offset_x, geometry.offset_y, geometry.width, geometry.width );
 	cropped_img = src( ROI );
 	
-	// create the unwrapped image and maps with same size as the cropped image
-	unwrapped_img.create( RADIUS, (int) 2*PI*RADIUS, cropped_img.type() );
-	map_x.create( unwrapped_img.size(), CV_32FC1 );
-	map_y.create( unwrapped_img.size(), CV_32FC1 );
-	
-	// develop the map arrays for the unwarping from polar coordinates
-	// i = y coord, j = x coord	
-	int rows = unwrapped_img.rows;
-	int cols = unwrapped_img.cols;
-	
-    for ( int i = 0; i < rows; i++ )
-    {
-        for ( int j = 0; j < cols; j++ )
-        {
-        	double theta = (double) j / RADIUS;// - (3*PI/2); // discretization in radians
-        	map_x.at<float>(rows-i,j) = CENTRE_X + i*sin(theta);
-        	map_y.at<float>(rows-i,j) = CENTRE_Y + i*cos(theta);
-        }
-    }
+	// create the unwrapped image, and the maps with the same size, as
+	// unwrap_video does so that the rows match the calibration lines
+	unwrapped_img.create( radius, geometry.unwrapped_width(), cropped_img.type() );
+	build_polar_maps( map_x, map_y, polar_radii( unwrapped_img.rows, 1 ), unwrapped_img.cols, 1.0 / radius,
+					  CENTRE_X, CENTRE_Y );
 	
 	gettimeofday( &calc_time, NULL);
 	// let OpenCV handle the interpolation for the gaps in the unwrapped image
@@ -0,0 +1,182 @@
+/*
+*  Anti-aliased unwrapping of the mirror straight into a panorama of any size.
+*
+*  Each output pixel covers a cell of the mirror in polar coordinates: an
+*  interval of radius (given per output row) by an interval of bearing (equal
+*  steps per output column). The pixel is the mean of a grid of bilinear
+*  samples spread evenly over its cell, with enough samples in each direction
+*  that they are no more than a source pixel apart. When the panorama is much
+*  smaller than the mirror this averages the whole footprint instead of
+*  aliasing as a single bilinear sample would, without unwrapping at full
+*  resolution and resizing; when it is as large or larger, it is a bilinear
+*  remap. Output rows are split across OpenCV's worker threads with
+*  cv::parallel_for_, so their number is set with cv::setNumThreads.
+*/
+
+#ifndef AREA_UNWRAP_HPP
+#define AREA_UNWRAP_HPP
+
+#include <opencv2/core/core.hpp>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+class AreaUnwrapper
+{
+public:
+	AreaUnwrapper() : centre( 0 ), bearing_step( 0 ), cols( 0 ), transposed( false ) {}
+
+	// Set up for a panorama with a row for each (centre, extent) of radius in
+	// radii (mirror pixels), and cols columns at bearings j*step (radians),
+	// sampling a mirror centred at (mirror_centre, mirror_centre). If
+	// transpose, the output is transposed, with the bearing down the rows.
+	void setup( const std::vector<cv::Vec2d> &radii, int num_cols, double step, double mirror_centre, bool transpose )
+	{
+		const int max_samples = 8;
+		centre = mirror_centre;
+		bearing_step = step;
+		cols = num_cols;
+		transposed = transpose;
+
+		rows.resize( radii.size() );
+		for ( size_t i = 0; i < radii.size(); i++ )
+		{
+			RowCell &row = rows[i];
+			double extent = radii[i][1];
+			int n = std::min( std::max( (int) ceil( extent ), 1 ), max_samples );
+			row.radii.resize( n );
+			for ( int k = 0; k < n; k++ )
+				row.radii[k] = radii[i][0] + ( ( k + 0.5 ) / n - 0.5 ) * extent;
+			// the arc at the outer edge of the cell is the longest
+			double arc = ( radii[i][0] + extent/2 ) * step;
+			row.bearings = std::min( std::max( (int) ceil( arc ), 1 ), max_samples );
+		}
+
+		sin_col.resize( cols );
+		cos_col.resize( cols );
+		for ( int j = 0; j < cols; j++ )
+		{
+			sin_col[j] = sin( j * step );
+			cos_col[j] = cos( j * step );
+		}
+
+		// the offsets of the sub-bearings, for each number of them
+		sin_offset.assign( max_samples+1, std::vector<double>() );
+		cos_offset.assign( max_samples+1, std::vector<double>() );
+		for ( int n = 1; n <= max_samples; n++ )
+			for ( int b = 0; b < n; b++ )
+			{
+				double offset = ( ( b + 0.5 ) / n - 0.5 ) * step;
+				sin_offset[n].push_back( sin( offset ) );
+				cos_offset[n].push_back( cos( offset ) );
+			}
+	}
+
+	cv::Size size() const
+	{
+		return transposed ? cv::Size( rows.size(), cols ) : cv::Size( cols, rows.size() );
+	}
+
+	// Unwrap src (8-bit, 1 or 3 channels) into dst, which is (re)created at
+	// size(). Only the columns [first, last) of the untransposed panorama are
+	// computed (all of them if last is negative).
+	void apply( const cv::Mat &src, cv::Mat &dst, int first = 0, int last = -1 ) const
+	{
+		CV_Assert( src.depth() == CV_8U && ( src.channels() == 1 || src.channels() == 3 ) );
+		dst.create( size(), src.type() );
+		if ( last < 0 )
+			last = cols;
+		cv::parallel_for_( cv::Range( 0, rows.size() ), RowsBody( *this, src, dst, first, last ) );
+	}
+
+private:
+	struct RowCell
+	{
+		std::vector<double> radii; // of the samples across the cell
+		int bearings;              // samples along the cell
+	};
+
+	// unwraps a range of output rows, for cv::parallel_for_
+	class RowsBody : public cv::ParallelLoopBody
+	{
+	public:
+		RowsBody( const AreaUnwrapper &unwrapper, const cv::Mat &src, cv::Mat &dst, int first, int last )
+			: unwrapper( unwrapper ), src( src ), dst( &dst ), first( first ), last( last ) {}
+
+		void operator()( const cv::Range &range ) const
+		{
+			if ( src.channels() == 3 )
+				unwrapper.unwrap_rows<3>( src, *dst, range.start, range.end, first, last );
+			else
+				unwrapper.unwrap_rows<1>( src, *dst, range.start, range.end, first, last );
+		}
+
+	private:
+		const AreaUnwrapper &unwrapper;
+		const cv::Mat &src;
+		cv::Mat *dst;
+		int first, last;
+	};
+
+	template <int CN>
+	void unwrap_rows( const cv::Mat &src, cv::Mat &dst, int row_first, int row_last, int first, int last ) const
+	{
+		for ( int i = row_first; i < row_last; i++ )
+		{
+			const RowCell &row = rows[i];
+			int nb = row.bearings;
+			const double *so = &sin_offset[nb][0], *co = &cos_offset[nb][0];
+			double scale = 1.0 / ( row.radii.size() * nb );
+			for ( int j = first; j < last; j++ )
+			{
+				double acc[CN] = { 0 };
+				for ( int b = 0; b < nb; b++ )
+				{
+					// sin and cos of the sub-bearing, by the angle sum
+					double s = sin_col[j]*co[b] + cos_col[j]*so[b];
+					double c = cos_col[j]*co[b] - sin_col[j]*so[b];
+					for ( size_t k = 0; k < row.radii.size(); k++ )
+						sample<CN>( src, centre + row.radii[k]*s, centre + row.radii[k]*c, acc );
+				}
+				uchar *out = transposed ? dst.ptr<uchar>( j ) + i*CN : dst.ptr<uchar>( i ) + j*CN;
+				for ( int ch = 0; ch < CN; ch++ )
+					out[ch] = cv::saturate_cast<uchar>( acc[ch] * scale );
+			}
+		}
+	}
+
+	// Add the bilinear sample at (x, y) to acc, with black outside the source.
+	template <int CN>
+	static inline void sample( const cv::Mat &src, double x, double y, double *acc )
+	{
+		int x0 = (int) floor( x ), y0 = (int) floor( y );
+		double fx = x - x0, fy = y - y0;
+		for ( int dy = 0; dy < 2; dy++ )
+		{
+			int yy = y0 + dy;
+			if ( (unsigned) yy >= (unsigned) src.rows )
+				continue;
+			const uchar *p = src.ptr<uchar>( yy );
+			double wy = dy ? fy : 1-fy;
+			for ( int dx = 0; dx < 2; dx++ )
+			{
+				int xx = x0 + dx;
+				if ( (unsigned) xx >= (unsigned) src.cols )
+					continue;
+				double w = wy * ( dx ? fx : 1-fx );
+				for ( int ch = 0; ch < CN; ch++ )
+					acc[ch] += w * p[xx*CN + ch];
+			}
+		}
+	}
+
+	double centre;
+	double bearing_step;
+	int cols;
+	bool transposed;
+	std::vector<RowCell> rows;
+	std::vector<double> sin_col, cos_col;
+	std::vector<std::vector<double> > sin_offset, cos_offset;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/*
+*  A cheap detector of change in the mirror image, so that unchanged frames
+*  (e.g. while the robot is parked) need not be unwrapped again.
+*
+*  The mirror is downsampled to a small greyscale image, each pixel the mean
+*  of a block of the mirror (computed here rather than with cv::resize, which
+*  takes a scratch buffer from the heap on every call), and split into angular
+*  sectors about its centre, matching the bearings of equal ranges of
+*  panorama columns. A sector has changed when its mean absolute difference
+*  from the reference, the image as it was when the sector was last
+*  recomputed, exceeds the threshold. Comparing against the reference rather
+*  than the previous frame means slow drift still triggers a recompute.
+*
+*  Only unwrap_video acts on the result, skipping its unwrap, tracker and
+*  compass for unchanged frames; the stereo tools still match every image
+*  they are given, hard-linked or not.
+*/
+
+#ifndef CHANGE_DETECTOR_HPP
+#define CHANGE_DETECTOR_HPP
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "mirror_geometry.hpp"
+
+class ChangeDetector
+{
+public:
+	ChangeDetector() : num_sectors( 0 ), threshold( 0 ), has_reference( false ) {}
+
+	// Split the mirror (width x width, centred at width/2, width/2) into
+	// sectors, each compared at size x size.
+	void setup( int sectors, double diff_threshold, int width = WIDTH, int size = 64 )
+	{
+		num_sectors = sectors;
+		threshold = diff_threshold;
+		has_reference = false;
+		current.create( size, size, CV_8UC1 );
+		cell_sums.assign( size*size, 0 );
+		// the block of each mirror row or column, and the size of each block
+		cell_of.resize( width );
+		cell_count.assign( size, 0 );
+		for ( int x = 0; x < width; x++ )
+		{
+			cell_of[x] = x * size / width;
+			cell_count[cell_of[x]]++;
+		}
+		sector_of.create( size, size, CV_32SC1 );
+		int radius = width/2;
+		for ( int y = 0; y < size; y++ )
+			for ( int x = 0; x < size; x++ )
+			{
+				// the bearing as the unwrap maps measure it, from x = r sin and
+				// y = r cos about the centre
+				double dx = ( x + 0.5 ) * width / size - radius;
+				double dy = ( y + 0.5 ) * width / size - radius;
+				double theta = atan2( dx, dy );
+				if ( theta < 0 )
+					theta += 2*PI;
+				int s = (int)( theta / ( 2*PI ) * num_sectors );
+				sector_of.at<int>( y, x ) = dx*dx + dy*dy > radius*radius ? -1 : std::min( s, num_sectors-1 );
+			}
+	}
+
+	// The panorama columns [first, last) covered by sector s.
+	void sector_columns( int s, int cols, int &first, int &last ) const
+	{
+		first = (int)( (long) s * cols / num_sectors );
+		last = (int)( (long)( s+1 ) * cols / num_sectors );
+	}
+
+	// Compare the mirror image with the reference, setting changed[s] for each
+	// sector which must be recomputed, and update the reference of those
+	// sectors. Returns the number of changed sectors. Everything has changed
+	// on the first call.
+	int update( const cv::Mat &mirror, std::vector<bool> &changed )
+	{
+		CV_Assert( mirror.depth() == CV_8U && mirror.rows == (int) cell_of.size() && mirror.cols == (int) cell_of.size() );
+		downsample( mirror );
+
+		changed.assign( num_sectors, true );
+		if ( !has_reference )
+		{
+			current.copyTo( reference );
+			has_reference = true;
+			return num_sectors;
+		}
+
+		sums.assign( num_sectors, 0 );
+		counts.assign( num_sectors, 0 );
+		for ( int y = 0; y < current.rows; y++ )
+		{
+			const uchar *cur = current.ptr<uchar>( y );
+			const uchar *ref = reference.ptr<uchar>( y );
+			const int *sec = sector_of.ptr<int>( y );
+			for ( int x = 0; x < current.cols; x++ )
+				if ( sec[x] >= 0 )
+				{
+					sums[sec[x]] += abs( cur[x] - ref[x] );
+					counts[sec[x]]++;
+				}
+		}
+
+		int num_changed = 0;
+		for ( int s = 0; s < num_sectors; s++ )
+		{
+			changed[s] = counts[s] == 0 || sums[s] > threshold * counts[s];
+			num_changed += changed[s];
+		}
+
+		// the recomputed sectors are the new reference
+		for ( int y = 0; y < current.rows; y++ )
+		{
+			const uchar *cur = current.ptr<uchar>( y );
+			uchar *ref = reference.ptr<uchar>( y );
+			const int *sec = sector_of.ptr<int>( y );
+			for ( int x = 0; x < current.cols; x++ )
+				if ( sec[x] >= 0 && changed[sec[x]] )
+					ref[x] = cur[x];
+		}
+		return num_changed;
+	}
+
+	int sectors() const { return num_sectors; }
+
+	// the downsampled images, so their buffers can come from a pool
+	cv::Mat current, reference;
+
+private:
+	// Downsample the mirror (8-bit, 1 or 3 channels) into current, in grey.
+	void downsample( const cv::Mat &mirror )
+	{
+		int size = current.rows, cn = mirror.channels();
+		std::fill( cell_sums.begin(), cell_sums.end(), 0 );
+		for ( int y = 0; y < mirror.rows; y++ )
+		{
+			const uchar *p = mirror.ptr<uchar>( y );
+			int *sums_row = &cell_sums[cell_of[y]*size];
+			if ( cn == 3 )
+			{
+				// the BGR to grey weights of cvtColor, in 8 bits
+				for ( int x = 0; x < mirror.cols; x++, p += 3 )
+					sums_row[cell_of[x]] += ( 29*p[0] + 150*p[1] + 77*p[2] ) >> 8;
+			}
+			else
+				for ( int x = 0; x < mirror.cols; x++ )
+					sums_row[cell_of[x]] += p[x];
+		}
+		for ( int y = 0; y < size; y++ )
+		{
+			uchar *out = current.ptr<uchar>( y );
+			for ( int x = 0; x < size; x++ )
+				out[x] = (uchar)( cell_sums[y*size + x] / ( cell_count[y]*cell_count[x] ) );
+		}
+	}
+
+	int num_sectors;
+	double threshold;         // mean absolute grey-level difference
+	bool has_reference;
+	cv::Mat sector_of;        // sector of each downsampled pixel, -1 outside the mirror
+	std::vector<long> sums, counts;
+	std::vector<int> cell_of, cell_count, cell_sums;
+};
+
+#endif
@@ -0,0 +1,232 @@
+/*
+*  A memory-mapped cache of decoded video frames, so that repeated runs over
+*  the same recording do not pay for decoding the video every time.
+*
+*  The video is decoded once and the mirror region of each frame is written
+*  raw to the cache file, after a header and an index of frame offsets. Later
+*  runs map the file and hand out cv::Mat headers pointing straight into the
+*  mapping, without copying. The cache is rebuilt whenever the size or
+*  modification time of the source video, or the requested region, changes.
+*  It is built under a temporary name and only renamed into place once
+*  complete, so an interrupted build leaves no cache which looks valid.
+*/
+
+#ifndef FRAME_CACHE_HPP
+#define FRAME_CACHE_HPP
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+struct FrameCacheHeader
+{
+	char magic[8];            // "UWFRAMES"
+	uint32_t version;
+	uint32_t num_frames;
+	int32_t rows, cols, type; // of each cached frame
+	int32_t requested[4];     // the region asked for (x, y, width, height)
+	int32_t region[4];        // the region cached, clipped to the frame
+	uint64_t source_size;     // for invalidation when the source changes
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	double decode_seconds;    // the time spent decoding the source
+	uint64_t index_offset;    // file offset of the uint64_t frame offsets
+};
+
+class FrameCache
+{
+public:
+	FrameCache() : base( NULL ), length( 0 ) {}
+	~FrameCache() { close(); }
+
+	// Map an existing cache of source_path, returning false if there is no
+	// valid cache for this source and region.
+	bool open( const std::string &cache_path, const std::string &source_path, const cv::Rect &requested )
+	{
+		close();
+		struct stat src_st;
+		if ( stat( source_path.c_str(), &src_st ) != 0 )
+			return false;
+
+		int fd = ::open( cache_path.c_str(), O_RDONLY );
+		if ( fd < 0 )
+			return false;
+		struct stat st;
+		if ( fstat( fd, &st ) != 0 || st.st_size < (off_t) sizeof(FrameCacheHeader) )
+		{
+			::close( fd );
+			return false;
+		}
+
+		void *p = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		::close( fd );
+		if ( p == MAP_FAILED )
+			return false;
+		base = (uchar*) p;
+		length = st.st_size;
+		madvise( base, length, MADV_SEQUENTIAL );
+
+		const FrameCacheHeader *h = header();
+		bool valid = memcmp( h->magic, "UWFRAMES", 8 ) == 0 && h->version == 1 &&
+			h->source_size == (uint64_t) src_st.st_size &&
+			h->source_mtime_sec == (int64_t) src_st.st_mtim.tv_sec &&
+			h->source_mtime_nsec == (int64_t) src_st.st_mtim.tv_nsec &&
+			h->requested[0] == requested.x && h->requested[1] == requested.y &&
+			h->requested[2] == requested.width && h->requested[3] == requested.height &&
+			h->num_frames > 0 && h->index_offset >= sizeof(FrameCacheHeader) &&
+			h->index_offset % sizeof(uint64_t) == 0 &&
+			h->index_offset + h->num_frames*sizeof(uint64_t) <= length;
+		// every frame must lie between the header and the index
+		for ( uint32_t i = 0; valid && i < h->num_frames; i++ )
+			valid = index()[i] >= sizeof(FrameCacheHeader) && index()[i] + frame_bytes() <= h->index_offset;
+		if ( !valid )
+			close();
+		return valid;
+	}
+
+	// Decode source_path once, writing the requested region of every frame to
+	// cache_path, then map the result.
+	bool build( const std::string &cache_path, const std::string &source_path, const cv::Rect &requested )
+	{
+		close();
+		struct stat src_st;
+		if ( stat( source_path.c_str(), &src_st ) != 0 )
+			return false;
+
+		cv::VideoCapture capture( source_path );
+		if ( !capture.isOpened() )
+			return false;
+
+		// written under a temporary name, so that an interrupted build is never
+		// mistaken for a cache
+		std::string tmp_path = cache_path + ".tmp";
+		FILE *fp = fopen( tmp_path.c_str(), "wb" );
+		if ( !fp )
+			return false;
+
+		FrameCacheHeader h;
+		memset( &h, 0, sizeof(h) );
+		memcpy( h.magic, "UWFRAMES", 8 );
+		h.version = 1;
+		h.requested[0] = requested.x;
+		h.requested[1] = requested.y;
+		h.requested[2] = requested.width;
+		h.requested[3] = requested.height;
+		h.source_size = src_st.st_size;
+		h.source_mtime_sec = src_st.st_mtim.tv_sec;
+		h.source_mtime_nsec = src_st.st_mtim.tv_nsec;
+		fwrite( &h, sizeof(h), 1, fp );
+
+		std::vector<uint64_t> offsets;
+		cv::Mat frame, region;
+		cv::Rect clipped;
+		uint64_t offset = sizeof(h);
+		struct timeval start_time, end_time;
+		double decode_seconds = 0;
+
+		while ( true )
+		{
+			gettimeofday( &start_time, NULL );
+			bool ok = capture.read( frame );
+			gettimeofday( &end_time, NULL );
+			if ( !ok )
+				break;
+			decode_seconds += (end_time.tv_sec - start_time.tv_sec) + 1e-6*(end_time.tv_usec - start_time.tv_usec);
+
+			if ( offsets.empty() )
+			{
+				clipped = requested & cv::Rect( 0, 0, frame.cols, frame.rows );
+				h.rows = clipped.height;
+				h.cols = clipped.width;
+				h.type = frame.type();
+			}
+
+			// copy so that the rows are contiguous
+			frame( clipped ).copyTo( region );
+			size_t bytes = region.total()*region.elemSize();
+			if ( fwrite( region.data, 1, bytes, fp ) != bytes )
+			{
+				fclose( fp );
+				unlink( tmp_path.c_str() );
+				return false;
+			}
+			offsets.push_back( offset );
+			offset += bytes;
+		}
+
+		// align the index of offsets
+		static const char padding[8] = { 0 };
+		size_t pad = ( 8 - offset % 8 ) % 8;
+		fwrite( padding, 1, pad, fp );
+		offset += pad;
+
+		h.num_frames = offsets.size();
+		h.region[0] = clipped.x;
+		h.region[1] = clipped.y;
+		h.region[2] = clipped.width;
+		h.region[3] = clipped.height;
+		h.decode_seconds = decode_seconds;
+		h.index_offset = offset;
+		bool ok = !offsets.empty() &&
+			fwrite( &offsets[0], sizeof(uint64_t), offsets.size(), fp ) == offsets.size();
+		ok = ok && fseek( fp, 0, SEEK_SET ) == 0 && fwrite( &h, sizeof(h), 1, fp ) == 1;
+		ok = fclose( fp ) == 0 && ok;
+		ok = ok && rename( tmp_path.c_str(), cache_path.c_str() ) == 0;
+		if ( !ok )
+		{
+			unlink( tmp_path.c_str() );
+			return false;
+		}
+
+		return open( cache_path, source_path, requested );
+	}
+
+	void close()
+	{
+		if ( base )
+			munmap( base, length );
+		base = NULL;
+		length = 0;
+	}
+
+	bool is_open() const { return base != NULL; }
+	int size() const { return base ? header()->num_frames : 0; }
+	double decode_seconds() const { return header()->decode_seconds; }
+
+	// the part of the source frame which is cached
+	cv::Rect region() const
+	{
+		const int32_t *r = header()->region;
+		return cv::Rect( r[0], r[1], r[2], r[3] );
+	}
+
+	// A header for frame i, pointing into the read-only mapping.
+	cv::Mat frame( int i ) const
+	{
+		const FrameCacheHeader *h = header();
+		return cv::Mat( h->rows, h->cols, h->type, base + index()[i] );
+	}
+
+private:
+	const FrameCacheHeader *header() const { return (const FrameCacheHeader*) base; }
+	const uint64_t *index() const { return (const uint64_t*)( base + header()->index_offset ); }
+	size_t frame_bytes() const
+	{
+		const FrameCacheHeader *h = header();
+		return (size_t) h->rows * h->cols * CV_ELEM_SIZE( h->type );
+	}
+
+	uchar *base;
+	size_t length;
+};
+
+#endif
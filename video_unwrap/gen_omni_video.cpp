@@ -0,0 +1,441 @@
+/*
+*  Generates synthetic video from a camera pointed at a two-lobed spherical
+*  mirror, as on the VirtualME robot, for benchmarking the unwrap, undistort
+*  and stereo stages at any mirror size and for measuring their accuracy
+*  against known depth.
+*
+*  The mirror is modelled as two concentric rings in the image: the outer
+*  (top) ring sees the scene from a viewpoint baseline/2 above the camera
+*  centre, the inner (bottom) ring from baseline/2 below, and within each ring
+*  the radius is a nonlinear function of the elevation angle, so that the
+*  undistortion has work to do. The scene is a rectangular room with
+*  cylindrical pillars, all of infinite height and textured with noise fixed
+*  to the world, so the depth along each bearing is known exactly and the
+*  disparity between the rings follows from it.
+*
+*  Besides the frames (a video, or images if the output name contains a
+*  printf-style %d), it writes:
+*    - calibration lines (rows of the unwrapped panorama at equal elevation
+*      steps, top ring then bottom ring) in the calibration_data_dense.txt
+*      format,
+*    - the mirror centre in each frame, as a .csv for unwrap_video -centre,
+*    - the mean mirror geometry, as a .yml for unwrap_video -geometry,
+*    - the ground truth (geometry, scene, depth per degree of bearing and the
+*      heading of each frame) as a .yml.
+*/
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mirror_geometry.hpp"
+#include "mirror_config.hpp"
+
+struct Pillar
+{
+	double x, y, radius;      // metres, in the room
+};
+
+struct Scene
+{
+	double room_x, room_y;    // half-sizes of the room, metres
+	double robot_x, robot_y;  // position of the mirror axis in the room
+	std::vector<Pillar> pillars;
+	uint32_t seed;
+};
+
+struct Optics
+{
+	int radius;               // of the mirror in the image, pixels
+	double outer_lo, outer_hi; // radii of the top ring, as fractions of the mirror radius
+	double inner_lo, inner_hi; // and of the bottom ring
+	double min_elevation, max_elevation; // radians
+	double gamma;             // nonlinearity of radius with elevation
+	double baseline;          // vertical separation of the two viewpoints, metres
+};
+
+int print_help()
+{
+	printf( "Usage: ./gen_omni_video <output.avi | frame_%%04d.png> [optional: -frames <n> -size <width>x<height> -radius <pixels> -centre <x,y> -jitter <pixels> -rotate <degrees per frame> -baseline <metres> -lines <n> -seed <n> -fps <fps> -threads <n> -calibration <file.txt> -centres <file.csv> -geometry <file.yml> -truth <file.yml> ]\n" );
+	return -1;
+}
+
+// A deterministic hash of a lattice point to [0, 1).
+static inline double lattice( int x, int y, int z, uint32_t seed )
+{
+	uint32_t h = seed ^ ( (uint32_t) x * 73856093u ) ^ ( (uint32_t) y * 19349663u ) ^ ( (uint32_t) z * 83492791u );
+	h ^= h >> 13;
+	h *= 0x5bd1e995u;
+	h ^= h >> 15;
+	return ( h & 0xffffff ) / 16777216.0;
+}
+
+// Smooth value noise in [0, 1) at a world point, trilinearly interpolated
+// from the lattice at unit spacing.
+static double value_noise( double x, double y, double z, uint32_t seed )
+{
+	int ix = (int) floor( x ), iy = (int) floor( y ), iz = (int) floor( z );
+	double fx = x - ix, fy = y - iy, fz = z - iz;
+	double v = 0;
+	for ( int c = 0; c < 8; c++ )
+	{
+		int dx = c & 1, dy = ( c >> 1 ) & 1, dz = c >> 2;
+		double w = ( dx ? fx : 1-fx ) * ( dy ? fy : 1-fy ) * ( dz ? fz : 1-fz );
+		v += w * lattice( ix+dx, iy+dy, iz+dz, seed );
+	}
+	return v;
+}
+
+// The horizontal distance from the robot to the first surface along world
+// bearing theta, and which surface it is (0 for the walls, 1+i for pillar i).
+static double scene_depth( const Scene &scene, double theta, int &surface )
+{
+	double dx = sin( theta ), dy = cos( theta );
+
+	// the walls of the room, from inside
+	double depth = 1e9;
+	if ( fabs( dx ) > 1e-12 )
+		depth = std::min( depth, ( ( dx > 0 ? scene.room_x : -scene.room_x ) - scene.robot_x ) / dx );
+	if ( fabs( dy ) > 1e-12 )
+		depth = std::min( depth, ( ( dy > 0 ? scene.room_y : -scene.room_y ) - scene.robot_y ) / dy );
+	surface = 0;
+
+	// the nearest pillar in front
+	for ( size_t i = 0; i < scene.pillars.size(); i++ )
+	{
+		const Pillar &p = scene.pillars[i];
+		double ox = p.x - scene.robot_x, oy = p.y - scene.robot_y;
+		double along = ox*dx + oy*dy;
+		double across_sq = ox*ox + oy*oy - along*along;
+		if ( along <= 0 || across_sq >= p.radius*p.radius )
+			continue;
+		double hit = along - sqrt( p.radius*p.radius - across_sq );
+		if ( hit > 0 && hit < depth )
+		{
+			depth = hit;
+			surface = 1 + i;
+		}
+	}
+	return depth;
+}
+
+// The elevation seen at a radius (as a fraction of the mirror radius) in a
+// ring, and the inverse.
+static double ring_elevation( const Optics &optics, double lo, double hi, double r )
+{
+	double t = pow( ( r - lo ) / ( hi - lo ), 1.0 / optics.gamma );
+	return optics.min_elevation + t * ( optics.max_elevation - optics.min_elevation );
+}
+
+static double ring_radius( const Optics &optics, double lo, double hi, double elevation )
+{
+	double t = ( elevation - optics.min_elevation ) / ( optics.max_elevation - optics.min_elevation );
+	return lo + ( hi - lo ) * pow( t, optics.gamma );
+}
+
+// Render rows [first, last) of a frame with the mirror centred at (cx, cy)
+// and the robot turned by heading (radians).
+static void render_rows( cv::Mat &frame, int first, int last, double cx, double cy, double heading,
+						 const Scene &scene, const Optics &optics )
+{
+	const double cell = 0.08; // metres per noise lattice cell
+	for ( int y = first; y < last; y++ )
+	{
+		cv::Vec3b *row = frame.ptr<cv::Vec3b>( y );
+		for ( int x = 0; x < frame.cols; x++ )
+		{
+			// bearings as the unwrap maps measure them, from x = r sin and
+			// y = r cos about the centre
+			double dx = x - cx, dy = y - cy;
+			double r = sqrt( dx*dx + dy*dy ) / optics.radius;
+			double z_view, elevation;
+			if ( r >= optics.outer_lo && r <= optics.outer_hi )
+			{
+				z_view = optics.baseline / 2;
+				elevation = ring_elevation( optics, optics.outer_lo, optics.outer_hi, r );
+			}
+			else if ( r >= optics.inner_lo && r <= optics.inner_hi )
+			{
+				z_view = -optics.baseline / 2;
+				elevation = ring_elevation( optics, optics.inner_lo, optics.inner_hi, r );
+			}
+			else
+			{
+				row[x] = cv::Vec3b( 0, 0, 0 );
+				continue;
+			}
+
+			// turning the robot moves the scene towards higher bearings
+			double theta = atan2( dx, dy ) - heading;
+			int surface;
+			double depth = scene_depth( scene, theta, surface );
+			double wx = scene.robot_x + depth*sin( theta ), wy = scene.robot_y + depth*cos( theta );
+			double wz = z_view + depth*tan( elevation );
+
+			// two octaves of noise on a per-surface base colour
+			for ( int c = 0; c < 3; c++ )
+			{
+				uint32_t seed = scene.seed + 101*c;
+				double n = 0.65*value_noise( wx/cell, wy/cell, wz/cell, seed ) +
+					0.35*value_noise( 3*wx/cell, 3*wy/cell, 3*wz/cell, seed + 7 );
+				double base = 60 + 120*lattice( surface, c, 0, scene.seed );
+				row[x][c] = cv::saturate_cast<uchar>( base + 150*( n - 0.5 ) );
+			}
+		}
+	}
+}
+
+int main( int argc, char** argv )
+{
+	if ( argc < 2 )
+		return print_help();
+
+	// by default, the VirtualME rig as unwrap_video expects it
+	int num_frames = 100;
+	int frame_width = 640, frame_height = 480;
+	bool centre_given = false, size_given = false;
+	double centre_x = OFFSET_X + RADIUS, centre_y = OFFSET_Y + RADIUS;
+	double jitter = 0, rotate = 0, fps = 30;
+	int num_lines = 13;
+	int num_threads = std::thread::hardware_concurrency();
+	const char *calibration_path = "synthetic_calibration.txt";
+	const char *centres_path = "synthetic_centres.csv";
+	const char *geometry_path = "synthetic_geometry.yml";
+	const char *truth_path = "synthetic_truth.yml";
+
+	Optics optics;
+	optics.radius = RADIUS;
+	optics.outer_lo = 0.57;
+	optics.outer_hi = 0.95;
+	optics.inner_lo = 0.28;
+	optics.inner_hi = 0.52;
+	optics.min_elevation = -25 * PI/180;
+	optics.max_elevation = 25 * PI/180;
+	optics.gamma = 1.3;
+	optics.baseline = 0.1;
+
+	Scene scene;
+	scene.seed = 1;
+
+	for ( int i = 2; i < argc; i++ )
+	{
+		if ( strcmp( "-frames", argv[i] ) == 0 && i+1 < argc )
+			num_frames = atoi( argv[++i] );
+		else if ( strcmp( "-size", argv[i] ) == 0 && i+1 < argc )
+		{
+			if ( sscanf( argv[++i], "%dx%d", &frame_width, &frame_height ) != 2 )
+				return print_help();
+			size_given = true;
+		}
+		else if ( strcmp( "-radius", argv[i] ) == 0 && i+1 < argc )
+		{
+			optics.radius = atoi( argv[++i] );
+			size_given = true;
+		}
+		else if ( strcmp( "-centre", argv[i] ) == 0 && i+1 < argc )
+		{
+			if ( sscanf( argv[++i], "%lf,%lf", &centre_x, &centre_y ) != 2 )
+				return print_help();
+			centre_given = true;
+		}
+		else if ( strcmp( "-jitter", argv[i] ) == 0 && i+1 < argc )
+			jitter = atof( argv[++i] );
+		else if ( strcmp( "-rotate", argv[i] ) == 0 && i+1 < argc )
+			rotate = atof( argv[++i] ) * PI/180;
+		else if ( strcmp( "-baseline", argv[i] ) == 0 && i+1 < argc )
+			optics.baseline = atof( argv[++i] );
+		else if ( strcmp( "-lines", argv[i] ) == 0 && i+1 < argc )
+			num_lines = atoi( argv[++i] );
+		else if ( strcmp( "-seed", argv[i] ) == 0 && i+1 < argc )
+			scene.seed = atoi( argv[++i] );
+		else if ( strcmp( "-fps", argv[i] ) == 0 && i+1 < argc )
+			fps = atof( argv[++i] );
+		else if ( strcmp( "-threads", argv[i] ) == 0 && i+1 < argc )
+			num_threads = atoi( argv[++i] );
+		else if ( strcmp( "-calibration", argv[i] ) == 0 && i+1 < argc )
+			calibration_path = argv[++i];
+		else if ( strcmp( "-centres", argv[i] ) == 0 && i+1 < argc )
+			centres_path = argv[++i];
+		else if ( strcmp( "-geometry", argv[i] ) == 0 && i+1 < argc )
+			geometry_path = argv[++i];
+		else if ( strcmp( "-truth", argv[i] ) == 0 && i+1 < argc )
+			truth_path = argv[++i];
+		else
+		{
+			printf( "Invalid option \"%s\" specified, exiting.\n", argv[i] );
+			return print_help();
+		}
+	}
+	if ( num_threads < 1 )
+		num_threads = 1;
+
+	// another rig puts the mirror in the middle of the frame
+	if ( size_given && !centre_given )
+	{
+		centre_x = frame_width / 2;
+		centre_y = frame_height / 2;
+	}
+	if ( num_frames < 1 || num_lines < 2 || optics.radius < 8 ||
+		 centre_x - optics.radius - jitter < 0 || centre_x + optics.radius + jitter > frame_width ||
+		 centre_y - optics.radius - jitter < 0 || centre_y + optics.radius + jitter > frame_height )
+	{
+		printf( "The mirror (with its jitter) must lie within the frame, exiting.\n" );
+		return -1;
+	}
+
+	// a room of 6-10m by 5-8m with the robot off centre and a few pillars
+	srand( scene.seed );
+	scene.room_x = 3 + 2 * ( rand() / (double) RAND_MAX );
+	scene.room_y = 2.5 + 1.5 * ( rand() / (double) RAND_MAX );
+	scene.robot_x = ( rand() / (double) RAND_MAX - 0.5 ) * scene.room_x * 0.5;
+	scene.robot_y = ( rand() / (double) RAND_MAX - 0.5 ) * scene.room_y * 0.5;
+	int num_pillars = 3 + rand() % 4;
+	for ( int i = 0; i < num_pillars; i++ )
+	{
+		Pillar p;
+		p.radius = 0.15 + 0.25 * ( rand() / (double) RAND_MAX );
+		p.x = ( rand() / (double) RAND_MAX * 2 - 1 ) * ( scene.room_x - p.radius );
+		p.y = ( rand() / (double) RAND_MAX * 2 - 1 ) * ( scene.room_y - p.radius );
+		// keep clear of the robot
+		if ( hypot( p.x - scene.robot_x, p.y - scene.robot_y ) > p.radius + 0.8 )
+			scene.pillars.push_back( p );
+	}
+
+	// the calibration lines: rows of the unwrapped panorama (row 0 at the
+	// mirror's edge, radius RADIUS-row) at equal steps of elevation, from
+	// the top down, for the top ring and then the bottom ring
+	FILE *fp = fopen( calibration_path, "w" );
+	if ( !fp )
+	{
+		printf( "Unable to open \"%s\" - exiting.\n", calibration_path );
+		return -1;
+	}
+	for ( int ring = 0; ring < 2; ring++ )
+	{
+		double lo = ring ? optics.inner_lo : optics.outer_lo, hi = ring ? optics.inner_hi : optics.outer_hi;
+		for ( int k = 0; k < num_lines; k++ )
+		{
+			double elevation = optics.max_elevation - k * ( optics.max_elevation - optics.min_elevation ) / ( num_lines-1 );
+			double r = ring_radius( optics, lo, hi, elevation ) * optics.radius;
+			fprintf( fp, "%d\n", (int) floor( optics.radius - r + 0.5 ) );
+		}
+	}
+	fclose( fp );
+
+	// the square about the mirror at its mean centre
+	MirrorGeometry geometry;
+	geometry.offset_x = (int) floor( centre_x - optics.radius + 0.5 );
+	geometry.offset_y = (int) floor( centre_y - optics.radius + 0.5 );
+	geometry.width = 2 * optics.radius;
+	if ( !save_mirror_geometry( geometry_path, geometry ) )
+	{
+		printf( "Unable to open \"%s\" - exiting.\n", geometry_path );
+		return -1;
+	}
+
+	bool images = strchr( argv[1], '%' ) != NULL;
+	cv::VideoWriter writer;
+	if ( !images )
+	{
+		writer.open( argv[1], CV_FOURCC( 'M', 'J', 'P', 'G' ), fps, cv::Size( frame_width, frame_height ) );
+		if ( !writer.isOpened() )
+		{
+			printf( "Failed to open video writer for \"%s\", exiting.\n", argv[1] );
+			return -1;
+		}
+	}
+
+	FILE *centres = fopen( centres_path, "w" );
+	if ( !centres )
+	{
+		printf( "Unable to open \"%s\" - exiting.\n", centres_path );
+		return -1;
+	}
+
+	printf( "Rendering %d %dx%d frames of a %d pixel mirror with %d threads...\n", num_frames,
+			frame_width, frame_height, optics.radius, num_threads );
+	struct timeval start_time, end_time;
+	gettimeofday( &start_time, NULL );
+
+	cv::Mat frame( frame_height, frame_width, CV_8UC3 );
+	std::vector<double> headings;
+	for ( int f = 0; f < num_frames; f++ )
+	{
+		// the centre jitters about its mean, the heading turns steadily
+		double cx = centre_x + jitter * ( 2 * ( rand() / (double) RAND_MAX ) - 1 );
+		double cy = centre_y + jitter * ( 2 * ( rand() / (double) RAND_MAX ) - 1 );
+		double heading = f * rotate;
+		headings.push_back( heading * 180/PI );
+
+		std::vector<std::thread> workers;
+		for ( int t = 0; t < num_threads; t++ )
+			workers.push_back( std::thread( render_rows, std::ref( frame ), t * frame_height / num_threads,
+											( t+1 ) * frame_height / num_threads, cx, cy, heading,
+											std::cref( scene ), std::cref( optics ) ) );
+		for ( int t = 0; t < num_threads; t++ )
+			workers[t].join();
+
+		if ( images )
+		{
+			char name[512];
+			snprintf( name, sizeof(name), argv[1], f );
+			cv::imwrite( name, frame );
+		}
+		else
+			writer << frame;
+		fprintf( centres, "%.2f,%.2f\n", cx, cy );
+	}
+	fclose( centres );
+
+	gettimeofday( &end_time, NULL );
+	double seconds = ( end_time.tv_sec - start_time.tv_sec ) + 1e-6 * ( end_time.tv_usec - start_time.tv_usec );
+	printf( "Done in %.3f seconds (%.1f ms per frame).\n", seconds, 1000 * seconds / num_frames );
+
+	// the ground truth
+	cv::FileStorage fs( truth_path, cv::FileStorage::WRITE );
+	if ( !fs.isOpened() )
+	{
+		printf( "Unable to open \"%s\" - exiting.\n", truth_path );
+		return -1;
+	}
+	fs << "frame_width" << frame_width << "frame_height" << frame_height;
+	fs << "mirror_radius" << optics.radius;
+	fs << "centre_x" << centre_x << "centre_y" << centre_y << "centre_jitter" << jitter;
+	fs << "top_ring" << "[" << optics.outer_lo << optics.outer_hi << "]";
+	fs << "bottom_ring" << "[" << optics.inner_lo << optics.inner_hi << "]";
+	fs << "min_elevation_deg" << optics.min_elevation * 180/PI << "max_elevation_deg" << optics.max_elevation * 180/PI;
+	fs << "elevation_gamma" << optics.gamma;
+	fs << "baseline" << optics.baseline;
+	fs << "calibration_lines" << num_lines;
+	fs << "room" << "[" << scene.room_x << scene.room_y << "]";
+	fs << "robot" << "[" << scene.robot_x << scene.robot_y << "]";
+	fs << "pillars" << "[";
+	for ( size_t i = 0; i < scene.pillars.size(); i++ )
+		fs << "{" << "x" << scene.pillars[i].x << "y" << scene.pillars[i].y << "radius" << scene.pillars[i].radius << "}";
+	fs << "]";
+
+	// the depth at each degree of bearing in the first frame's panorama
+	std::vector<double> depths;
+	for ( int d = 0; d < 360; d++ )
+	{
+		int surface;
+		depths.push_back( scene_depth( scene, d * PI/180, surface ) );
+	}
+	fs << "depth_per_degree" << depths;
+	fs << "heading_deg" << headings;
+	fs.release();
+
+	printf( "Wrote calibration lines to \"%s\", centres to \"%s\", geometry to \"%s\" and ground truth to \"%s\".\n",
+			calibration_path, centres_path, geometry_path, truth_path );
+	return 0;
+}
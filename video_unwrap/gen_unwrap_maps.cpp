@@ -0,0 +1,66 @@
+/*
+*  Build-time generator for the unwrap maps of the fixed mirror geometry in
+*  mirror_geometry.hpp. Writes a header (to stdout) holding the polar maps in
+*  OpenCV's fixed-point remap format, so that a FIXED_GEOMETRY build of
+*  unwrap_video embeds them and spends no time building maps at startup.
+*
+*  The maps match build_polar_maps() in polar_maps.hpp at full resolution.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#include "mirror_geometry.hpp"
+
+// as OpenCV's INTER_BITS / INTER_TAB_SIZE
+const int FRAC_BITS = 5;
+const int FRAC_SIZE = 1 << FRAC_BITS;
+
+int main()
+{
+	const int rows = RADIUS;
+	const int cols = UNWRAPPED_WIDTH;
+
+	printf( "// Generated by gen_unwrap_maps from mirror_geometry.hpp - do not edit.\n" );
+	printf( "#ifndef UNWRAP_MAPS_GENERATED_H\n#define UNWRAP_MAPS_GENERATED_H\n\n" );
+	printf( "const int UNWRAP_GEN_WIDTH = %d;\n", WIDTH );
+	printf( "const int UNWRAP_ROWS = %d;\n", rows );
+	printf( "const int UNWRAP_COLS = %d;\n", cols );
+	printf( "const int UNWRAP_FRAC_BITS = %d;\n\n", FRAC_BITS );
+
+	// integer source coordinates (x, y) and fractions ((fy << FRAC_BITS) | fx)
+	// of each panorama pixel, as produced by cv::convertMaps to CV_16SC2
+	std::vector<short> xy( rows*cols*2 );
+	std::vector<unsigned short> frac( rows*cols );
+	for ( int i = 0; i < rows; i++ )
+	{
+		// as polar_radii(): radius rows-i, with row 0 repeating row 1
+		int r = i == 0 ? rows-1 : rows-i;
+		for ( int j = 0; j < cols; j++ )
+		{
+			double theta = (double) j / RADIUS;
+			float x = RADIUS + r*sin(theta);
+			float y = RADIUS + r*cos(theta);
+			int ix = (int) lrint( x*FRAC_SIZE );
+			int iy = (int) lrint( y*FRAC_SIZE );
+			int k = i*cols + j;
+			xy[2*k] = ix >> FRAC_BITS;
+			xy[2*k+1] = iy >> FRAC_BITS;
+			frac[k] = ( (iy & (FRAC_SIZE-1)) << FRAC_BITS ) | ( ix & (FRAC_SIZE-1) );
+		}
+	}
+
+	printf( "static const short unwrap_map_xy[UNWRAP_ROWS*UNWRAP_COLS*2] = {" );
+	for ( int i = 0; i < rows; i++ )
+		for ( int j = 0; j < cols; j++ )
+			printf( "%s%d,%d,", j % 12 ? " " : "\n\t", xy[2*(i*cols+j)], xy[2*(i*cols+j)+1] );
+	printf( "\n};\n\n" );
+
+	printf( "static const unsigned short unwrap_map_frac[UNWRAP_ROWS*UNWRAP_COLS] = {" );
+	for ( int i = 0; i < rows; i++ )
+		for ( int j = 0; j < cols; j++ )
+			printf( "%s%d,", j % 16 ? " " : "\n\t", frac[i*cols+j] );
+	printf( "\n};\n\n#endif\n" );
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+*  Counts the heap allocations made by each thread, by interposing on the
+*  glibc allocation functions (operator new, and OpenCV's fastMalloc, come
+*  through these too). This sees every allocation, including those OpenCV
+*  makes for its own scratch buffers, which the buffer pool cannot.
+*
+*  The functions are defined here rather than declared, so include this from
+*  exactly one translation unit of a program. Elsewhere than glibc nothing is
+*  counted and heap_allocations() returns -1.
+*/
+
+#ifndef HEAP_COUNTER_HPP
+#define HEAP_COUNTER_HPP
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef __GLIBC__
+
+// thread-local, so that the count of the frame loop excludes other threads
+static __thread long thread_heap_allocations = 0;
+
+extern "C"
+{
+	void *__libc_malloc( size_t size );
+	void *__libc_calloc( size_t count, size_t size );
+	void *__libc_realloc( void *ptr, size_t size );
+	void *__libc_memalign( size_t alignment, size_t size );
+
+	void *malloc( size_t size )
+	{
+		thread_heap_allocations++;
+		return __libc_malloc( size );
+	}
+
+	void *calloc( size_t count, size_t size )
+	{
+		thread_heap_allocations++;
+		return __libc_calloc( count, size );
+	}
+
+	void *realloc( void *ptr, size_t size )
+	{
+		thread_heap_allocations++;
+		return __libc_realloc( ptr, size );
+	}
+
+	void *memalign( size_t alignment, size_t size )
+	{
+		thread_heap_allocations++;
+		return __libc_memalign( alignment, size );
+	}
+
+	void *aligned_alloc( size_t alignment, size_t size )
+	{
+		thread_heap_allocations++;
+		return __libc_memalign( alignment, size );
+	}
+
+	int posix_memalign( void **ptr, size_t alignment, size_t size )
+	{
+		if ( alignment % sizeof(void*) != 0 || ( alignment & ( alignment-1 ) ) != 0 )
+			return EINVAL;
+		thread_heap_allocations++;
+		void *p = __libc_memalign( alignment, size );
+		if ( !p )
+			return ENOMEM;
+		*ptr = p;
+		return 0;
+	}
+}
+
+// The number of heap allocations the calling thread has made.
+static inline long heap_allocations() { return thread_heap_allocations; }
+
+#else
+
+static inline long heap_allocations() { return -1; }
+
+#endif
+
+#endif
@@ -0,0 +1,178 @@
+/*
+*  Low-latency live capture: a capture thread keeps only the newest frame, so
+*  that when processing falls behind, stale frames are dropped rather than
+*  queued and latency does not grow.
+*
+*  The source is a camera index, or a video file which is replayed in real
+*  time at its native frame rate to simulate a camera without hardware.
+*/
+
+#ifndef LIVE_CAPTURE_HPP
+#define LIVE_CAPTURE_HPP
+
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mat_pool.hpp"
+#include "pipeline_metrics.hpp"
+
+// seconds on a monotonic clock, for timestamping frames
+static inline double live_clock()
+{
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+class LiveCapture
+{
+public:
+	LiveCapture() : captured( 0 ), dropped( 0 ), simulated( false ), fresh( false ),
+					finished( false ), latest_time( 0 ) {}
+	~LiveCapture() { stop(); }
+
+	// Open a camera (if source is a number) or a video file to replay in real
+	// time, and start the capture thread. Frame buffers come from pool.
+	bool start( const std::string &source, MatPool &pool )
+	{
+		simulated = source.find_first_not_of( "0123456789" ) != std::string::npos;
+		if ( simulated )
+			capture.open( source );
+		else
+			capture.open( atoi( source.c_str() ) );
+		if ( !capture.isOpened() )
+			return false;
+
+		pool.attach( back );
+		pool.attach( latest );
+		finished = false;
+		worker = std::thread( &LiveCapture::run, this );
+		return true;
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			finished = true;
+		}
+		ready.notify_all();
+		if ( worker.joinable() )
+			worker.join();
+
+		// hand the buffers back to the pool while it is certainly alive
+		back.release();
+		latest.release();
+	}
+
+	// Wait for a frame newer than the last one taken and swap it into frame,
+	// with its capture time. Returns false once the source has ended.
+	bool next( cv::Mat &frame, double &capture_time )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		while ( !fresh && !finished )
+			ready.wait( lock );
+		if ( !fresh )
+			return false;
+
+		std::swap( frame, latest );
+		capture_time = latest_time;
+		fresh = false;
+		return true;
+	}
+
+	bool is_simulated() const { return simulated; }
+
+	// frames captured but not yet taken (at most one)
+	int pending() const { return fresh ? 1 : 0; }
+
+	std::atomic<long> captured;   // frames grabbed from the source
+	std::atomic<long> dropped;    // frames replaced before being taken
+
+private:
+	void run()
+	{
+		double fps = simulated ? capture.get( CV_CAP_PROP_FPS ) : 0;
+		if ( simulated && !( fps > 0 ) )
+			fps = 30;
+		double start_time = live_clock();
+		long n = 0;
+
+		cv::Mat grabbed;
+		while ( true )
+		{
+			{
+				std::lock_guard<std::mutex> lock( mutex );
+				if ( finished )
+					break;
+			}
+
+			// a simulated camera delivers each frame at its time in the video
+			if ( simulated )
+			{
+				double due = start_time + n / fps;
+				double wait = due - live_clock();
+				if ( wait > 0 )
+					std::this_thread::sleep_for( std::chrono::duration<double>( wait ) );
+			}
+
+			if ( !capture.read( grabbed ) )
+				break;
+			double t = live_clock();
+			n++;
+
+			// read() may hand back the capture's own buffer, so copy it out
+			// before publishing
+			grabbed.copyTo( back );
+			{
+				std::lock_guard<std::mutex> lock( mutex );
+				std::swap( back, latest );
+				latest_time = t;
+				if ( fresh )
+					dropped++;
+				fresh = true;
+			}
+			captured++;
+			ready.notify_one();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			finished = true;
+		}
+		ready.notify_all();
+	}
+
+	cv::VideoCapture capture;
+	bool simulated;
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable ready;
+	cv::Mat back, latest;     // the frame being filled and the newest frame
+	std::atomic<bool> fresh;  // latest has not been taken yet
+	bool finished;
+	double latest_time;
+};
+
+// Print the percentiles of latencies counted in the metrics' buckets, and
+// the largest (in seconds), as milliseconds.
+static void print_latency_percentiles( const long *counts, long total, double max_seconds )
+{
+	if ( total == 0 )
+		return;
+	const double percentiles[] = { 50, 90, 99 };
+	printf( "Capture-to-output latency over %ld frames:", total );
+	for ( int i = 0; i < 3; i++ )
+		printf( " p%.0f %.1fms", percentiles[i], 1000*PipelineMetrics::percentile( counts, total, percentiles[i]/100 ) );
+	printf( " max %.1fms\n", 1000*max_seconds );
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+*  A cv::MatAllocator which keeps released buffers in a pool and hands them out
+*  again for later requests of the same size, so that the buffers of a frame
+*  loop which are attached to it stop being reallocated once it has warmed up.
+*
+*  Counts heap allocations, pool reuses and releases so that the steady state
+*  can be checked.
+*/
+
+#ifndef MAT_POOL_HPP
+#define MAT_POOL_HPP
+
+#include <opencv2/core/core.hpp>
+#include <stdlib.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+class MatPool : public cv::MatAllocator
+{
+public:
+	MatPool() : heap_allocations( 0 ), reuses( 0 ), releases( 0 ), heap_bytes( 0 ) {}
+
+	~MatPool()
+	{
+		for ( std::map<size_t, std::vector<uchar*> >::iterator it = free_blocks.begin(); it != free_blocks.end(); ++it )
+			for ( size_t i = 0; i < it->second.size(); i++ )
+				free( it->second[i] );
+	}
+
+	// Make m allocate (on its next create) from this pool.
+	void attach( cv::Mat &m ) { m.allocator = this; }
+
+	void allocate( int dims, const int *sizes, int type, int *&refcount,
+				   uchar *&datastart, uchar *&data, size_t *step )
+	{
+		step[dims-1] = CV_ELEM_SIZE( type );
+		for ( int i = dims-1; i > 0; i-- )
+			step[i-1] = step[i]*sizes[i];
+		size_t capacity = cv::alignSize( step[0]*sizes[0], 16 );
+
+		uchar *block = NULL;
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			std::vector<uchar*> &blocks = free_blocks[capacity];
+			if ( !blocks.empty() )
+			{
+				block = blocks.back();
+				blocks.pop_back();
+				reuses++;
+			}
+			else
+			{
+				// the header holds the capacity; the refcount follows the data
+				block = (uchar*) malloc( HEADER + capacity + sizeof(int) );
+				if ( !block )
+					CV_Error( CV_StsNoMem, "MatPool: out of memory" );
+				*(size_t*) block = capacity;
+				heap_allocations++;
+				heap_bytes += capacity;
+			}
+		}
+
+		datastart = data = block + HEADER;
+		refcount = (int*)( datastart + capacity );
+		*refcount = 1;
+	}
+
+	void deallocate( int *refcount, uchar *datastart, uchar *data )
+	{
+		(void) refcount;
+		(void) data;
+		uchar *block = datastart - HEADER;
+		std::lock_guard<std::mutex> lock( mutex );
+		free_blocks[*(size_t*) block].push_back( block );
+		releases++;
+	}
+
+	// atomic, so that they can be read while another thread allocates
+	std::atomic<size_t> heap_allocations;  // buffers taken from the heap
+	std::atomic<size_t> reuses;            // requests served from the pool
+	std::atomic<size_t> releases;          // buffers returned to the pool
+	std::atomic<size_t> heap_bytes;        // total size of the buffers taken from the heap
+
+private:
+	static const size_t HEADER = 16; // keeps the data 16-byte aligned
+
+	std::mutex mutex;
+	std::map<size_t, std::vector<uchar*> > free_blocks;
+};
+
+#endif
@@ -0,0 +1,44 @@
+/*
+*  Saving and loading the mirror geometry as a FileStorage (.yml or .xml)
+*  file, so that a different camera or mirror needs no rebuild:
+*
+*    offset_x: 96
+*    offset_y: 8
+*    width: 452
+*/
+
+#ifndef MIRROR_CONFIG_HPP
+#define MIRROR_CONFIG_HPP
+
+#include <opencv2/core/core.hpp>
+
+#include "mirror_geometry.hpp"
+
+static bool save_mirror_geometry( const char *filename, const MirrorGeometry &geometry )
+{
+	cv::FileStorage fs( filename, cv::FileStorage::WRITE );
+	if ( !fs.isOpened() )
+		return false;
+	fs << "offset_x" << geometry.offset_x;
+	fs << "offset_y" << geometry.offset_y;
+	fs << "width" << geometry.width;
+	return true;
+}
+
+// Load the geometry, which must describe a mirror of at least a few pixels.
+static bool load_mirror_geometry( const char *filename, MirrorGeometry &geometry )
+{
+	cv::FileStorage fs( filename, cv::FileStorage::READ );
+	if ( !fs.isOpened() || fs["offset_x"].empty() || fs["offset_y"].empty() || fs["width"].empty() )
+		return false;
+	MirrorGeometry loaded;
+	fs["offset_x"] >> loaded.offset_x;
+	fs["offset_y"] >> loaded.offset_y;
+	fs["width"] >> loaded.width;
+	if ( loaded.offset_x < 0 || loaded.offset_y < 0 || loaded.width < 8 )
+		return false;
+	geometry = loaded;
+	return true;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+*  The geometry of the mirror in the VirtualME nav camera image. The constants
+*  are the default rig, which the build-time map generator bakes into
+*  FIXED_GEOMETRY builds; MirrorGeometry holds the geometry in use, which may
+*  be loaded at runtime with mirror_config.hpp.
+*/
+
+#ifndef MIRROR_GEOMETRY_HPP
+#define MIRROR_GEOMETRY_HPP
+
+#define PI 3.141592654
+
+// define the image parameters for cropping the mirror - should be a square
+const int OFFSET_X = 96;
+const int OFFSET_Y = 8;
+//const int WIDTH = 465; // old width... ugh
+const int WIDTH = 452;
+const int HEIGHT = WIDTH;
+const int RADIUS = WIDTH/2;
+const double UNWRAPPED_WIDTH = 2*PI*RADIUS;
+
+struct MirrorGeometry
+{
+	int offset_x, offset_y;   // top left of the square about the mirror
+	int width;                // of the square, the diameter of the mirror
+
+	MirrorGeometry() : offset_x( OFFSET_X ), offset_y( OFFSET_Y ), width( WIDTH ) {}
+
+	int radius() const { return width/2; }
+	int unwrapped_width() const { return (int)( 2*PI*radius() ); }
+	bool is_default() const { return offset_x == OFFSET_X && offset_y == OFFSET_Y && width == WIDTH; }
+};
+
+#endif
@@ -0,0 +1,351 @@
+/*
+*  A lightweight people tracker for the cyclic panorama: background
+*  subtraction on a downscaled copy of the panorama, blobs of foreground, and
+*  nearest-neighbour tracking of their bearings.
+*
+*  The panorama wraps around at 0/360 degrees, so blobs touching both edges
+*  are merged into one and bearings are compared cyclically. Bearings are
+*  measured in radians from the first column, independent of the working
+*  resolution. Given the transposed top/bottom pair, the range of each
+*  confirmed track is estimated by matching only the rows of the pair which
+*  lie along its bearings.
+*
+*  The tracker keeps to a per-frame budget, which includes the matching, by
+*  lowering its working resolution whenever its recent mean cost exceeds the
+*  budget.
+*/
+
+#ifndef PEOPLE_TRACKER_HPP
+#define PEOPLE_TRACKER_HPP
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "mirror_geometry.hpp"
+#include "pipeline_metrics.hpp"
+
+struct PersonTrack
+{
+	int id;
+	double bearing;           // radians, in [0, 2*PI)
+	double velocity;          // radians per frame
+	double width;             // angular width, radians
+	double elevation;         // centre row as a fraction of the panorama height
+	int hits;                 // frames in which the track was matched
+	int misses;               // consecutive frames without a match
+	double range;             // from disparity, or negative if unknown
+
+	bool confirmed() const { return hits >= 3; }
+};
+
+class PeopleTracker
+{
+public:
+	PeopleTracker() : frames( 0 ), total_seconds( 0 ), overruns( 0 ), scale( 0.25 ), budget( 0 ),
+					  next_id( 1 ), window_seconds( 0 ), window_frames( 0 ), max_seconds( 0 ), bm( CV_STEREO_BM_BASIC, 32, 5 )
+	{
+		for ( int b = 0; b < PipelineMetrics::NUM_BUCKETS; b++ )
+			cost_counts[b] = 0;
+	}
+
+	// Work at scale times the input resolution, lowering it to keep the mean
+	// cost under budget_seconds (no limit if zero).
+	void setup( double work_scale, double budget_seconds )
+	{
+		scale = work_scale;
+		budget = budget_seconds;
+	}
+
+	// Track the people in the next panorama, given with the bearing along the
+	// columns, or down the rows if transposed. If baseline_focal is positive,
+	// also estimate the range of each confirmed track from the transposed
+	// top and bottom images.
+	void update( const cv::Mat &panorama, bool transposed, const cv::Mat &top = cv::Mat(),
+				 const cv::Mat &bottom = cv::Mat(), double baseline_focal = 0 )
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		// grey has the bearing along the columns; a transposed panorama goes
+		// through its own buffer, so that no buffer changes shape each frame
+		cv::resize( panorama, small, cv::Size(), scale, scale, cv::INTER_AREA );
+		cv::Mat &untransposed = transposed ? small_grey : grey;
+		if ( small.channels() == 3 )
+			cv::cvtColor( small, untransposed, CV_BGR2GRAY );
+		else
+			small.copyTo( untransposed );
+		if ( transposed )
+			cv::transpose( small_grey, grey );
+
+		if ( background.size() != grey.size() )
+			grey.convertTo( background, CV_32F );
+		else
+		{
+			detect();
+			associate();
+			// only learn the background where there is nobody
+			cv::bitwise_not( foreground, background_mask );
+			cv::accumulateWeighted( grey, background, 0.02, background_mask );
+		}
+		if ( baseline_focal > 0 )
+			set_ranges( top, bottom, baseline_focal );
+
+		double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		frames++;
+		total_seconds += seconds;
+		cost_counts[PipelineMetrics::bucket_of( seconds )]++;
+		max_seconds = std::max( max_seconds, seconds );
+		if ( budget > 0 && seconds > budget )
+			overruns++;
+
+		// lower the resolution if over budget, starting a new background
+		window_seconds += seconds;
+		if ( ++window_frames == 30 )
+		{
+			if ( budget > 0 && window_seconds / window_frames > budget && scale > 0.05 )
+			{
+				scale *= 0.8;
+				background.release();
+				printf( "Tracking over budget, reducing its resolution to %.3g.\n", scale );
+			}
+			window_seconds = 0;
+			window_frames = 0;
+		}
+	}
+
+	const std::vector<PersonTrack> &tracks() const { return track_list; }
+
+	void print_report() const
+	{
+		if ( frames == 0 )
+			return;
+		printf( "Tracking: %d frames at %.1f fps, per-frame cost mean %.2fms p90 %.2fms max %.2fms",
+				frames, frames / total_seconds, 1000*total_seconds/frames,
+				1000*PipelineMetrics::percentile( cost_counts, frames, 0.9 ), 1000*max_seconds );
+		if ( budget > 0 )
+			printf( ", %d over the %.2fms budget", overruns, 1000*budget );
+		printf( ".\n" );
+	}
+
+	// the benchmark
+	int frames;
+	double total_seconds;
+	int overruns;
+
+private:
+	struct Blob
+	{
+		double bearing, width, elevation;
+	};
+
+	// the cyclic difference between two bearings, in (-PI, PI]
+	static double bearing_diff( double a, double b )
+	{
+		double d = fmod( a - b, 2*PI );
+		if ( d > PI )
+			d -= 2*PI;
+		else if ( d <= -PI )
+			d += 2*PI;
+		return d;
+	}
+
+	static double wrap_bearing( double a )
+	{
+		a = fmod( a, 2*PI );
+		return a < 0 ? a + 2*PI : a;
+	}
+
+	// Estimate the range of each confirmed track from the transposed pair
+	// (rows along the bearing), as baseline_focal / disparity, matching only
+	// the rows of its bearings, with enough rows either side for the block
+	// and prefilter windows. People are nearer than what lies behind them, so
+	// the upper quartile of the valid disparities is used.
+	void set_ranges( const cv::Mat &top, const cv::Mat &bottom, double baseline_focal )
+	{
+		int rows = top.rows;
+		int margin = bm.state->SADWindowSize/2 + 1;
+		for ( size_t t = 0; t < track_list.size(); t++ )
+		{
+			PersonTrack &track = track_list[t];
+			track.range = -1;
+			if ( !track.confirmed() )
+				continue;
+
+			int first = (int) floor( ( track.bearing - track.width/2 ) / ( 2*PI ) * rows );
+			int last = (int) ceil( ( track.bearing + track.width/2 ) / ( 2*PI ) * rows );
+			int strip_rows = std::min( last - first + 1 + 2*margin, rows );
+			copy_cyclic_rows( top, first - margin, strip_rows, top_strip );
+			copy_cyclic_rows( bottom, first - margin, strip_rows, bottom_strip );
+			bm( top_strip, bottom_strip, strip_disparity );
+
+			values.clear();
+			for ( int r = margin; r < strip_rows - margin; r++ )
+			{
+				const short *row = strip_disparity.ptr<short>( r );
+				for ( int c = 0; c < strip_disparity.cols; c++ )
+					if ( row[c] > 0 )
+						values.push_back( row[c] );
+			}
+			if ( values.size() < 20 )
+				continue;
+			std::vector<short>::iterator q = values.begin() + values.size()*3/4;
+			std::nth_element( values.begin(), q, values.end() );
+			track.range = baseline_focal / ( *q / 16.0 );
+		}
+	}
+
+	// Copy n rows of src from first on, wrapping around the panorama seam,
+	// into dst in greyscale.
+	void copy_cyclic_rows( const cv::Mat &src, int first, int n, cv::Mat &dst )
+	{
+		strip.create( n, src.cols, src.type() );
+		for ( int k = 0; k < n; k++ )
+			src.row( ( ( first + k ) % src.rows + src.rows ) % src.rows ).copyTo( strip.row( k ) );
+		if ( strip.channels() == 3 )
+			cv::cvtColor( strip, dst, CV_BGR2GRAY );
+		else
+			strip.copyTo( dst );
+	}
+
+	// Find the blobs of foreground, merging those split by the wrap.
+	void detect()
+	{
+		cv::convertScaleAbs( background, background8 );
+		cv::absdiff( grey, background8, difference );
+		cv::threshold( difference, foreground, 25, 255, cv::THRESH_BINARY );
+		cv::morphologyEx( foreground, foreground, cv::MORPH_OPEN, cv::Mat() );
+		cv::dilate( foreground, foreground, cv::Mat(), cv::Point(-1,-1), 2 );
+
+		foreground.copyTo( contour_img );
+		contours.clear();
+		cv::findContours( contour_img, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE );
+
+		int cols = foreground.cols, rows = foreground.rows;
+		double min_area = 0.003 * rows * cols;
+		rects.clear();
+		for ( size_t i = 0; i < contours.size(); i++ )
+			if ( cv::contourArea( contours[i] ) >= min_area )
+				rects.push_back( cv::boundingRect( contours[i] ) );
+
+		// a blob at the right edge continues one at the left edge when their
+		// rows overlap; extend it past the edge and drop the left one
+		for ( size_t i = 0; i < rects.size(); i++ )
+		{
+			if ( rects[i].x + rects[i].width != cols )
+				continue;
+			for ( size_t j = 0; j < rects.size(); j++ )
+			{
+				if ( j == i || rects[j].x != 0 || ( rects[i] & cv::Rect( cols-1, rects[j].y, 1, rects[j].height ) ).area() == 0 )
+					continue;
+				int top = std::min( rects[i].y, rects[j].y );
+				int bottom = std::max( rects[i].y + rects[i].height, rects[j].y + rects[j].height );
+				rects[i] = cv::Rect( rects[i].x, top, rects[i].width + rects[j].width, bottom - top );
+				rects.erase( rects.begin() + j );
+				if ( j < i )
+					i--;
+				break;
+			}
+		}
+
+		blobs.clear();
+		for ( size_t i = 0; i < rects.size(); i++ )
+		{
+			Blob b;
+			b.bearing = wrap_bearing( ( rects[i].x + rects[i].width/2.0 ) * 2*PI / cols );
+			b.width = rects[i].width * 2*PI / cols;
+			b.elevation = ( rects[i].y + rects[i].height/2.0 ) / rows;
+			blobs.push_back( b );
+		}
+	}
+
+	// Match the blobs to the predicted tracks, nearest pairs first.
+	void associate()
+	{
+		const double gate = 10 * PI/180;
+		pairs.clear();
+		for ( size_t t = 0; t < track_list.size(); t++ )
+		{
+			double predicted = track_list[t].bearing + track_list[t].velocity;
+			for ( size_t b = 0; b < blobs.size(); b++ )
+			{
+				double d = fabs( bearing_diff( blobs[b].bearing, predicted ) );
+				if ( d < gate + blobs[b].width/2 )
+					pairs.push_back( std::make_pair( d, std::make_pair( (int) t, (int) b ) ) );
+			}
+		}
+		std::sort( pairs.begin(), pairs.end() );
+
+		track_matched.assign( track_list.size(), false );
+		blob_matched.assign( blobs.size(), false );
+		for ( size_t p = 0; p < pairs.size(); p++ )
+		{
+			int t = pairs[p].second.first, b = pairs[p].second.second;
+			if ( track_matched[t] || blob_matched[b] )
+				continue;
+			track_matched[t] = blob_matched[b] = true;
+
+			PersonTrack &track = track_list[t];
+			double step = bearing_diff( blobs[b].bearing, track.bearing );
+			track.velocity = 0.5*track.velocity + 0.5*step;
+			track.bearing = blobs[b].bearing;
+			track.width = blobs[b].width;
+			track.elevation = blobs[b].elevation;
+			track.hits++;
+			track.misses = 0;
+		}
+
+		// coast the unmatched tracks, dropping those lost for too long
+		for ( int t = (int) track_list.size()-1; t >= 0; t-- )
+		{
+			if ( track_matched[t] )
+				continue;
+			PersonTrack &track = track_list[t];
+			track.bearing = wrap_bearing( track.bearing + track.velocity );
+			if ( ++track.misses > 10 || !track.confirmed() )
+				track_list.erase( track_list.begin() + t );
+		}
+
+		for ( size_t b = 0; b < blobs.size(); b++ )
+		{
+			if ( blob_matched[b] )
+				continue;
+			PersonTrack track;
+			track.id = next_id++;
+			track.bearing = blobs[b].bearing;
+			track.velocity = 0;
+			track.width = blobs[b].width;
+			track.elevation = blobs[b].elevation;
+			track.hits = 1;
+			track.misses = 0;
+			track.range = -1;
+			track_list.push_back( track );
+		}
+	}
+
+	double scale;
+	double budget;            // seconds per frame
+	int next_id;
+	double window_seconds;    // cost over the recent frames
+	int window_frames;
+	long cost_counts[PipelineMetrics::NUM_BUCKETS];  // per-frame costs, in the metrics' buckets
+	double max_seconds;
+
+	cv::Mat small, small_grey, grey, background, background8, background_mask;
+	cv::Mat difference, foreground, contour_img;
+	std::vector<std::vector<cv::Point> > contours;
+	std::vector<cv::Rect> rects;
+	std::vector<Blob> blobs;
+	std::vector<std::pair<double, std::pair<int, int> > > pairs;
+	std::vector<bool> track_matched, blob_matched;
+	std::vector<PersonTrack> track_list;
+	std::vector<short> values;
+
+	cv::StereoBM bm;          // for the track ranges
+	cv::Mat strip, top_strip, bottom_strip, strip_disparity;
+};
+
+#endif
@@ -0,0 +1,399 @@
+/*
+*  Metrics for a long-running frame pipeline: frames processed, frame rate,
+*  per-stage latency percentiles, live capture queue depth and dropped frames,
+*  and memory use.
+*
+*  The frame loop updates the metrics with relaxed atomics only, so it never
+*  blocks on a reader. A background thread renders them in the Prometheus text
+*  format, serving them over HTTP on a local port, writing them periodically
+*  to a file, or both.
+*
+*  Stage latencies are kept in histograms with geometrically spaced buckets,
+*  and each report gives the percentiles of the frames since the previous
+*  report (of the same kind, so scrapes and file writes do not interfere), so
+*  that a regression shows up rather than being averaged away.
+*
+*  Given a counter of the frame loop's heap allocations, the allocations made
+*  in each stage are counted too.
+*/
+
+#ifndef PIPELINE_METRICS_HPP
+#define PIPELINE_METRICS_HPP
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <math.h>
+#include <string>
+#include <thread>
+
+class PipelineMetrics
+{
+public:
+	enum Stage { READ, DETECT, UNWRAP, LEVELS, UNDISTORT, TRACK, COMPASS, OUTPUT, FRAME, NUM_STAGES };
+
+	// buckets grow by a factor of 1.25 from 10us, the last catching the rest
+	static const int NUM_BUCKETS = 64;
+
+	PipelineMetrics() : frames( 0 ), skipped( 0 ), captured( 0 ), dropped( 0 ), queue_depth( 0 ), pool_bytes( 0 ),
+						last_frame_us( 0 ), allocation_counter( NULL ), last_allocations( 0 ), frame_allocations( 0 ),
+						listen_fd( -1 ), interval( 5 ), running( false )
+	{
+		for ( int s = 0; s < NUM_STAGES; s++ )
+		{
+			stage_sum_us[s] = 0;
+			stage_allocations[s] = 0;
+			for ( int b = 0; b < NUM_BUCKETS; b++ )
+				buckets[s][b] = 0;
+		}
+		start_us = now_us();
+		file_window.time = http_window.time = start_us;
+	}
+
+	~PipelineMetrics() { stop(); }
+
+	// Count the heap allocations of each stage with counter, which returns
+	// the frame loop thread's allocations so far.
+	void count_allocations( long (*counter)() )
+	{
+		allocation_counter = counter;
+		last_allocations = frame_allocations = counter();
+	}
+
+	// Record the time spent in a stage for the current frame, and the heap
+	// allocations since the previous stage (or for FRAME, since the previous
+	// frame).
+	void record( Stage stage, double seconds )
+	{
+		buckets[stage][bucket_of( seconds )].fetch_add( 1, std::memory_order_relaxed );
+		stage_sum_us[stage].fetch_add( (int64_t)( seconds*1e6 ), std::memory_order_relaxed );
+		if ( allocation_counter )
+		{
+			long now = allocation_counter();
+			stage_allocations[stage].fetch_add( now - ( stage == FRAME ? frame_allocations : last_allocations ),
+												std::memory_order_relaxed );
+			last_allocations = now;
+		}
+	}
+
+	// Mark a frame as fully processed.
+	void frame_done()
+	{
+		frames.fetch_add( 1, std::memory_order_relaxed );
+		last_frame_us.store( now_us(), std::memory_order_relaxed );
+		if ( allocation_counter )
+			last_allocations = frame_allocations = allocation_counter();
+	}
+
+	// Serve the metrics at http://127.0.0.1:<port>/metrics and/or write them
+	// to filename every interval seconds. Either may be disabled (port 0,
+	// filename NULL).
+	bool start( int port, const char *filename, double interval_seconds )
+	{
+		if ( port > 0 )
+		{
+			listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+			int on = 1;
+			setsockopt( listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+			struct sockaddr_in addr;
+			memset( &addr, 0, sizeof(addr) );
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+			addr.sin_port = htons( port );
+			if ( listen_fd < 0 || bind( listen_fd, (struct sockaddr*) &addr, sizeof(addr) ) != 0 ||
+				 listen( listen_fd, 4 ) != 0 )
+			{
+				if ( listen_fd >= 0 )
+					close( listen_fd );
+				listen_fd = -1;
+				return false;
+			}
+		}
+		if ( filename )
+			metrics_file = filename;
+		interval = interval_seconds > 0 ? interval_seconds : 5;
+		running = true;
+		worker = std::thread( &PipelineMetrics::run, this );
+		return true;
+	}
+
+	void stop()
+	{
+		running = false;
+		if ( worker.joinable() )
+			worker.join();
+		if ( listen_fd >= 0 )
+			close( listen_fd );
+		listen_fd = -1;
+	}
+
+	// The state at the previous report, from which the frame rate and
+	// percentiles of the next are measured.
+	struct Window
+	{
+		Window() : frames( 0 ), time( 0 ) { memset( buckets, 0, sizeof(buckets) ); }
+		long buckets[NUM_STAGES][NUM_BUCKETS];
+		long frames;
+		int64_t time;
+	};
+
+	// The metrics in the Prometheus text format, with the frame rate and
+	// percentiles covering the frames since the window was last rendered.
+	std::string render( Window &last )
+	{
+		int64_t now = now_us();
+		long n = frames.load( std::memory_order_relaxed );
+		double window = ( now - last.time ) * 1e-6;
+		double fps = window > 0 ? ( n - last.frames ) / window : 0;
+		last.frames = n;
+		last.time = now;
+		int64_t last_frame = last_frame_us.load( std::memory_order_relaxed );
+
+		std::string out;
+		char buff[256];
+		add( out, "unwrap_frames_total", "counter", "Frames fully processed.", n );
+		add( out, "unwrap_frames_skipped_total", "counter", "Frames skipped as unchanged.",
+			 skipped.load( std::memory_order_relaxed ) );
+		add( out, "unwrap_fps", "gauge", "Frames per second since the previous report.", fps );
+		add( out, "unwrap_uptime_seconds", "gauge", "Seconds since the pipeline started.", ( now - start_us ) * 1e-6 );
+		add( out, "unwrap_seconds_since_last_frame", "gauge", "Seconds since a frame was last completed.",
+			 last_frame ? ( now - last_frame ) * 1e-6 : ( now - start_us ) * 1e-6 );
+		add( out, "unwrap_live_frames_captured_total", "counter", "Frames grabbed from a live source.",
+			 captured.load( std::memory_order_relaxed ) );
+		add( out, "unwrap_live_frames_dropped_total", "counter", "Live frames replaced before being processed.",
+			 dropped.load( std::memory_order_relaxed ) );
+		add( out, "unwrap_live_queue_depth", "gauge", "Live frames waiting to be processed.",
+			 queue_depth.load( std::memory_order_relaxed ) );
+		add( out, "unwrap_pool_heap_bytes", "gauge", "Bytes taken from the heap by the frame buffer pool.",
+			 (double) pool_bytes.load( std::memory_order_relaxed ) );
+		add( out, "unwrap_resident_bytes", "gauge", "Resident memory of the process.", resident_bytes() );
+
+		out += "# HELP unwrap_stage_seconds Time spent in each stage per frame, percentiles since the previous report.\n";
+		out += "# TYPE unwrap_stage_seconds summary\n";
+		static const double quantiles[] = { 0.5, 0.9, 0.99 };
+		for ( int s = 0; s < NUM_STAGES; s++ )
+		{
+			// the counts since the previous report
+			long window_counts[NUM_BUCKETS], total = 0, window_total = 0;
+			for ( int b = 0; b < NUM_BUCKETS; b++ )
+			{
+				long count = buckets[s][b].load( std::memory_order_relaxed );
+				window_counts[b] = count - last.buckets[s][b];
+				last.buckets[s][b] = count;
+				total += count;
+				window_total += window_counts[b];
+			}
+			for ( int q = 0; q < 3; q++ )
+			{
+				snprintf( buff, sizeof(buff), "unwrap_stage_seconds{stage=\"%s\",quantile=\"%g\"} %s\n", stage_name( s ),
+						  quantiles[q], format( percentile( window_counts, window_total, quantiles[q] ) ).c_str() );
+				out += buff;
+			}
+			snprintf( buff, sizeof(buff), "unwrap_stage_seconds_sum{stage=\"%s\"} %.6f\n", stage_name( s ),
+					  stage_sum_us[s].load( std::memory_order_relaxed ) * 1e-6 );
+			out += buff;
+			snprintf( buff, sizeof(buff), "unwrap_stage_seconds_count{stage=\"%s\"} %ld\n", stage_name( s ), total );
+			out += buff;
+		}
+
+		if ( allocation_counter )
+		{
+			out += "# HELP unwrap_stage_heap_allocations_total Heap allocations made by the frame loop in each stage.\n";
+			out += "# TYPE unwrap_stage_heap_allocations_total counter\n";
+			for ( int s = 0; s < NUM_STAGES; s++ )
+			{
+				snprintf( buff, sizeof(buff), "unwrap_stage_heap_allocations_total{stage=\"%s\"} %ld\n", stage_name( s ),
+						  stage_allocations[s].load( std::memory_order_relaxed ) );
+				out += buff;
+			}
+		}
+		return out;
+	}
+
+	// updated by the frame loop
+	std::atomic<long> frames;
+	std::atomic<long> skipped;
+	std::atomic<long> captured;
+	std::atomic<long> dropped;
+	std::atomic<int> queue_depth;
+	std::atomic<size_t> pool_bytes;
+	std::atomic<long> stage_allocations[NUM_STAGES];
+
+	static const char *stage_name( int stage )
+	{
+		static const char *names[NUM_STAGES] = { "read", "detect", "unwrap", "levels", "undistort", "track", "compass", "output", "frame" };
+		return names[stage];
+	}
+
+	// The histogram buckets, public so that other per-frame times can be kept
+	// in the same bounded form.
+	static int bucket_of( double seconds )
+	{
+		if ( !( seconds > 1e-5 ) )
+			return 0;
+		int b = 1 + (int)( log( seconds / 1e-5 ) / log( 1.25 ) );
+		return b < NUM_BUCKETS ? b : NUM_BUCKETS-1;
+	}
+
+	// the upper bound of bucket b, in seconds
+	static double bucket_bound( int b ) { return 1e-5 * pow( 1.25, b ); }
+
+	// Estimate a percentile from bucket counts, interpolating within the
+	// bucket it falls in. NaN if there are no counts.
+	static double percentile( const long *counts, long total, double q )
+	{
+		if ( total <= 0 )
+			return NAN;
+		double rank = q * total;
+		long seen = 0;
+		for ( int b = 0; b < NUM_BUCKETS; b++ )
+		{
+			if ( counts[b] > 0 && seen + counts[b] >= rank )
+			{
+				double lower = b > 0 ? bucket_bound( b-1 ) : 0;
+				return lower + ( bucket_bound( b ) - lower ) * ( rank - seen ) / counts[b];
+			}
+			seen += counts[b];
+		}
+		return bucket_bound( NUM_BUCKETS-1 );
+	}
+
+private:
+	static std::string format( double value )
+	{
+		if ( value != value )
+			return "NaN";
+		char buff[32];
+		snprintf( buff, sizeof(buff), "%.6g", value );
+		return buff;
+	}
+
+	static void add( std::string &out, const char *name, const char *type, const char *help, double value )
+	{
+		out += std::string( "# HELP " ) + name + " " + help + "\n";
+		out += std::string( "# TYPE " ) + name + " " + type + "\n";
+		out += std::string( name ) + " " + format( value ) + "\n";
+	}
+
+	static double resident_bytes()
+	{
+		long pages = 0, resident = 0;
+		FILE *fp = fopen( "/proc/self/statm", "r" );
+		if ( !fp )
+			return NAN;
+		int read = fscanf( fp, "%ld %ld", &pages, &resident );
+		fclose( fp );
+		return read == 2 ? (double) resident * sysconf( _SC_PAGESIZE ) : NAN;
+	}
+
+	static int64_t now_us()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch() ).count();
+	}
+
+	void run()
+	{
+		int64_t next_write = now_us();
+		while ( running )
+		{
+			if ( !metrics_file.empty() && now_us() >= next_write )
+			{
+				write_file();
+				next_write = now_us() + (int64_t)( interval*1e6 );
+			}
+
+			// wait for a scrape, waking regularly to check for shutdown
+			if ( listen_fd >= 0 )
+			{
+				struct pollfd pfd = { listen_fd, POLLIN, 0 };
+				if ( poll( &pfd, 1, 100 ) > 0 )
+					serve_one();
+			}
+			else
+				usleep( 100000 );
+		}
+		if ( !metrics_file.empty() )
+			write_file();
+	}
+
+	// Write to a temporary file and rename it, so readers never see a
+	// partial report.
+	void write_file()
+	{
+		std::string tmp = metrics_file + ".tmp";
+		FILE *fp = fopen( tmp.c_str(), "w" );
+		if ( !fp )
+			return;
+		std::string text = render( file_window );
+		bool ok = fwrite( text.data(), 1, text.size(), fp ) == text.size();
+		if ( fclose( fp ) == 0 && ok )
+			rename( tmp.c_str(), metrics_file.c_str() );
+	}
+
+	void serve_one()
+	{
+		int fd = accept( listen_fd, NULL, NULL );
+		if ( fd < 0 )
+			return;
+		// a client which connects and then stalls (a health check, a port
+		// scan) must not hold up the file writes or shutdown
+		struct timeval timeout = { 0, 500000 };
+		setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+		setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+		char request[1024];
+		ssize_t len = recv( fd, request, sizeof(request)-1, 0 );
+		request[len > 0 ? len : 0] = '\0';
+
+		std::string response;
+		if ( strncmp( request, "GET /metrics ", 13 ) == 0 || strncmp( request, "GET / ", 6 ) == 0 )
+		{
+			std::string body = render( http_window );
+			char header[128];
+			snprintf( header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+					  "Content-Length: %d\r\n\r\n", (int) body.size() );
+			response = header + body;
+		}
+		else
+			response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+
+		size_t sent = 0;
+		while ( sent < response.size() )
+		{
+			ssize_t n = send( fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL );
+			if ( n <= 0 )
+				break;
+			sent += n;
+		}
+		close( fd );
+	}
+
+	std::atomic<long> buckets[NUM_STAGES][NUM_BUCKETS];
+	std::atomic<int64_t> stage_sum_us[NUM_STAGES];
+	std::atomic<int64_t> last_frame_us;
+	int64_t start_us;
+
+	// used only by the frame loop
+	long (*allocation_counter)();
+	long last_allocations;    // at the end of the previous stage
+	long frame_allocations;   // at the end of the previous frame
+
+	int listen_fd;
+	std::string metrics_file;
+	double interval;
+	std::atomic<bool> running;
+	std::thread worker;
+
+	// used only by the worker
+	Window file_window, http_window;
+};
+
+#endif
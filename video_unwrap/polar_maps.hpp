@@ -0,0 +1,61 @@
+/*
+*  The polar maps which unwrap the mirror into a panorama, shared by unwrap
+*  and unwrap_video so that both put each radius on the same panorama row,
+*  the row the calibration line files refer to.
+*/
+
+#ifndef POLAR_MAPS_HPP
+#define POLAR_MAPS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+// The radius in mirror pixels (centre, extent) covered by each row of a
+// panorama with the given number of rows, where scale is the panorama
+// resolution relative to one pixel per pixel of mirror radius. Row y lies at
+// radius rows-y (at full resolution), as the calibration files assume, so
+// row 0 would be on the edge of the mirror square; it repeats row 1 instead.
+static std::vector<cv::Vec2d> polar_radii( int rows, double scale )
+{
+	std::vector<cv::Vec2d> radii( rows );
+	for ( int y = 0; y < rows; y++ )
+		radii[y] = cv::Vec2d( std::min( rows-y, rows-1 ) / scale, 1 / scale );
+	return radii;
+}
+
+// Develop the map arrays for unwarping a mirror centred at (centre_x,
+// centre_y) from polar coordinates into an image with a row for each of radii
+// and cols columns at bearings j*step radians.
+// i = y coord, j = x coord
+static void build_polar_maps( cv::Mat &map_x, cv::Mat &map_y, const std::vector<cv::Vec2d> &radii, int cols,
+							  double step, double centre_x, double centre_y )
+{
+	int rows = radii.size();
+	map_x.create( rows, cols, CV_32FC1 );
+	map_y.create( rows, cols, CV_32FC1 );
+
+	// the bearing of a column is the same on every row
+	std::vector<double> sin_theta( cols ), cos_theta( cols );
+	for ( int j = 0; j < cols; j++ )
+	{
+		double theta = j * step; // discretization in radians
+		sin_theta[j] = sin(theta);
+		cos_theta[j] = cos(theta);
+	}
+
+	for ( int i = 0; i < rows; i++ )
+	{
+		float *x_row = map_x.ptr<float>( i );
+		float *y_row = map_y.ptr<float>( i );
+		double r = radii[i][0];
+		for ( int j = 0; j < cols; j++ )
+		{
+			x_row[j] = centre_x + r*sin_theta[j];
+			y_row[j] = centre_y + r*cos_theta[j];
+		}
+	}
+}
+
+#endif
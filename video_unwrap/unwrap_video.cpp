@@ -9,6 +9,92 @@
 *  Supports the inclusion of a .csv file containing the coordinates of the
 *  centre of the mirror for stabilized unwrapped images.
 *
+*  For repeated runs over the same recording, -cache <file> decodes the video
+*  once into a memory-mapped cache of the mirror region of each frame, which
+*  later runs read from directly instead of decoding the video again.
+*
+*  With -live, frames are taken from a capture thread which keeps only the
+*  newest frame, so latency stays bounded when processing falls behind. The
+*  source is then a camera index, or a video file replayed in real time as a
+*  simulated camera. Latency percentiles and dropped frames are reported.
+*
+*  The per-frame buffers are allocated from a pool, so none of them is
+*  reallocated once warmed up, and the sections are undistorted by remapping
+*  through precomputed maps rather than resized, so that no scratch buffers
+*  are needed either. -alloc-check <warm-up frames> runs without display and
+*  verifies this, counting every malloc and new on the frame loop's thread:
+*  it exits with an error if a pooled buffer moves, or if the unwrapping
+*  stages (detect, unwrap, levels, undistort, and the read from a -cache)
+*  make any heap allocation once warmed up. The allocations of the other
+*  stages (decoding, tracking, the compass, output) are reported per stage,
+*  as they are in the metrics.
+*
+*  Building with FIXED_GEOMETRY (make fixed) embeds the full-resolution maps,
+*  generated at build time by gen_unwrap_maps for the geometry in
+*  mirror_geometry.hpp, in remap's fixed-point format, so cv::remap uses them
+*  as they are and no time is spent building maps at startup (the time taken
+*  to ready the maps is printed either way). Other geometries and panorama
+*  sizes fall back to maps built at startup.
+*
+*  The mirror geometry defaults to that in mirror_geometry.hpp; -geometry
+*  <file.yml> loads another (offset_x, offset_y, width, as gen_omni_video
+*  writes), so a different camera needs no rebuild. -scale <s> in (0, 1]
+*  unwraps the main panorama, and with it the top and bottom images, at s
+*  times the full resolution (the calibration lines are scaled to match).
+*  With -aa each panorama pixel (of the main panorama, the levels and the
+*  transposed images) is the mean of samples spread over its whole footprint
+*  on the mirror rather than one bilinear sample, so a high resolution camera
+*  can be unwrapped straight to a moderate size without aliasing and without
+*  a full resolution unwrap and resize. The rows are split over OpenCV's
+*  worker threads, which -threads <n> sets the number of (default, one per
+*  core); this applies to OpenCV's own parallel loops too.
+*
+*  For long runs, -metrics-port <port> serves frame counts, frame rate,
+*  per-stage latency percentiles, live queue depth, dropped frames and memory
+*  use at http://127.0.0.1:<port>/metrics in the Prometheus text format, and
+*  -metrics-file <file> writes the same report every -metrics-interval
+*  seconds (default 5). The per-frame region of interest is only printed with
+*  -verbose.
+*
+*  With -transpose the top and bottom images are written transposed, with the
+*  bearing down the rows, so that their vertical disparity becomes horizontal
+*  and they can go straight to a horizontal matcher (StereoBM, StereoSGBM)
+*  without transposing every frame. The panorama is unwrapped already
+*  transposed, by transposed maps, and the sections are undistorted by
+*  transposed section maps, which is the untransposed pipeline with rows and
+*  columns swapped.
+*  -verify-transpose runs without display and also runs the untransposed
+*  pipeline on every frame, checking the output against its cv::transpose.
+*  The check exits with an error if they differ by more than a grey level,
+*  and reports the largest difference seen.
+*
+*  When the scene is often static (e.g. a parked robot), -static <threshold>
+*  compares a downsampled copy of the mirror with the image as last
+*  processed, and skips all of the work for frames whose mean absolute grey
+*  level difference is below the threshold, reusing the previous outputs:
+*  saved images are hard links to the previous frame's, the tracks are kept
+*  and the compass reports no rotation. With -static-sectors <n> the mirror
+*  is split into n angular sectors and only the bearings of the changed
+*  sectors are recomputed. Skip ratios are reported at the end.
+*
+*  -track <tracks.csv> runs a lightweight people tracker (background
+*  subtraction and blob tracking on a downscaled copy of the panorama, at
+*  -track-scale, default 0.25) and writes the bearing of each confirmed track
+*  per frame. With -transpose, -track-range <baseline*focal> also gives each
+*  confirmed track a range, matching only the rows of the top and bottom
+*  images along its bearings. The tracker, ranges included, lowers its
+*  resolution to keep within -track-budget milliseconds per frame (default 5),
+*  and its frame rate and per-frame cost are reported at the end.
+*
+*  -compass <heading.csv> estimates the rotation of the robot between frames
+*  from the cyclic shift of the panorama's column intensity profile (by FFT
+*  cross-correlation) and writes the rotation and accumulated heading for each
+*  frame; -compass-subpixel refines the shift to a fraction of a column.
+*
+*  Additional panorama resolutions (e.g. a low-resolution panorama for people
+*  tracking) can be requested with -levels. Each level is sampled directly from
+*  the mirror with its own maps rather than resized from the full panorama.
+*
 *  Ben Selby, August 2013
 */
 
@@ -16,20 +102,28 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <stdio.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
-#define PI 3.141592654
-
-// define the image parameters for cropping the mirror - should be a square
-const int OFFSET_X = 96;
-const int OFFSET_Y = 8;
-//const int WIDTH = 465; // old width... ugh
-const int WIDTH = 452;
-const int HEIGHT = WIDTH;
-const int RADIUS = WIDTH/2;
-const double UNWRAPPED_WIDTH = 2*PI*RADIUS;
+#include "mirror_geometry.hpp"
+#include "mirror_config.hpp"
+#include "polar_maps.hpp"
+#include "area_unwrap.hpp"
+#include "frame_cache.hpp"
+#include "mat_pool.hpp"
+#include "heap_counter.hpp"
+#include "live_capture.hpp"
+#include "pipeline_metrics.hpp"
+#include "change_detector.hpp"
+#include "people_tracker.hpp"
+#include "visual_compass.hpp"
+#ifdef FIXED_GEOMETRY
+#include "unwrap_maps_generated.h"
+#endif
 
 const std::string output_path = "output/";
 
@@ -37,10 +131,77 @@ const std::string output_path = "output/";
 
 int print_help()
 {
-    printf( "Usage: ./unwrap_video <video_filename> <calibration_data.txt> <number of lines> [optional: -height <section height> -save -centre <file.csv> ] \n");
+    printf( "Usage: ./unwrap_video <video_filename | camera index> <calibration_data.txt> <number of lines> [optional: -height <section height> -save -centre <file.csv> -levels <scale,scale,...> -cache <file> -alloc-check <warm-up frames> -live -verbose -metrics-port <port> -metrics-file <file> -metrics-interval <seconds> -transpose -verify-transpose -static <threshold> -static-sectors <n> -track <tracks.csv> -track-scale <scale> -track-budget <ms> -track-range <baseline*focal> -compass <heading.csv> -compass-subpixel -geometry <file.yml> -scale <scale> -aa -threads <n> ] \n");
     return -1;
 }
 
+// Parse a comma-separated list of panorama scales, e.g. "0.5,0.25". Each scale
+// must lie in (0, 1].
+bool parse_levels( const char *arg, std::vector<double> &scales )
+{
+	std::stringstream ss( arg );
+	std::string item;
+	while ( getline( ss, item, ',' ) )
+	{
+		double scale = atof( item.c_str() );
+		if ( scale <= 0 || scale > 1 )
+			return false;
+		scales.push_back( scale );
+	}
+	return !scales.empty();
+}
+
+// Build the maps which undistort the panorama into the top or bottom image,
+// stretching each section between consecutive calibration lines (rows of the
+// panorama) to section_height rows, sampling as cv::resize does with
+// INTER_LINEAR. If transposed, the panorama and the image are transposed. The
+// maps are converted to fixed-point, so remap need not convert them on every
+// call.
+void build_section_maps( const int *lines, int num_lines, int section_height, int cols, bool transposed,
+						 cv::Mat &map1, cv::Mat &map2 )
+{
+	int rows = ( num_lines-1 )*section_height;
+	cv::Mat map_x( rows, cols, CV_32FC1 ), map_y( rows, cols, CV_32FC1 );
+	for ( int i = 0; i < num_lines-1; i++ )
+	{
+		int height = lines[i+1] - lines[i];
+		for ( int k = 0; k < section_height; k++ )
+		{
+			// clamped to the section, as resize clamps to its source
+			double y = ( k + 0.5 ) * height / section_height - 0.5;
+			y = lines[i] + std::min( std::max( y, 0.0 ), height - 1.0 );
+			float *x_row = map_x.ptr<float>( i*section_height + k );
+			float *y_row = map_y.ptr<float>( i*section_height + k );
+			for ( int j = 0; j < cols; j++ )
+			{
+				x_row[j] = j;
+				y_row[j] = y;
+			}
+		}
+	}
+	if ( transposed )
+	{
+		// the transposed image samples the transposed panorama, so the
+		// coordinates swap as well as the maps
+		cv::Mat transposed_x, transposed_y;
+		cv::transpose( map_y, transposed_x );
+		cv::transpose( map_x, transposed_y );
+		cv::convertMaps( transposed_x, transposed_y, map1, map2, CV_16SC2 );
+	}
+	else
+		cv::convertMaps( map_x, map_y, map1, map2, CV_16SC2 );
+}
+
+// Undistort the panorama columns [first, last) into output through the
+// section maps, or the rows if transposed.
+void undistort_sections( const cv::Mat &panorama, cv::Mat &output, const cv::Mat &map1, const cv::Mat &map2,
+						 int first, int last, bool transposed )
+{
+	cv::Rect span = transposed ? cv::Rect( 0, first, output.cols, last - first ) : cv::Rect( first, 0, last - first, output.rows );
+	cv::Mat output_span = output( span );
+	cv::remap( panorama, output_span, map1( span ), map2( span ), CV_INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0,0,0) );
+}
+
 int get_time_diff( struct timeval *result, struct timeval *t1, struct timeval *t2 )
 {
     long int diff = (t2->tv_usec + 1000000*t2->tv_sec) - (t1->tv_usec + 1000000*t1->tv_sec);
@@ -55,6 +216,29 @@ int main( int argc, char** argv )
 	bool save = false;
 	bool variable_centre = false;
 	int centre_arg_num;	
+	std::vector<double> level_scales;
+	const char *cache_path = NULL;
+	bool display = true;
+	int alloc_check_warmup = -1; // frames before checking for allocations
+	bool live = false;
+	bool verbose = false;
+	int metrics_port = 0;
+	const char *metrics_path = NULL;
+	double metrics_interval = 5;
+	bool transpose = false;
+	bool verify_transpose = false;
+	double static_threshold = -1; // no change detection
+	int static_sectors = 1;
+	const char *track_path = NULL;
+	double track_scale = 0.25;
+	double track_budget = 5;      // milliseconds
+	double track_baseline_focal = 0; // no ranges
+	const char *compass_path = NULL;
+	bool compass_subpixel = false;
+	MirrorGeometry geometry;
+	double scale = 1;             // of the panorama
+	bool area = false;            // anti-aliased unwrap
+	int num_threads = 0;          // of OpenCV's parallel loops, 0 for its default
 	
 	// height of the individual 'unwarped' sections
 	int section_height = 10;		
@@ -82,6 +266,125 @@ int main( int argc, char** argv )
     			std::cout<<"Stabilization file found."<<std::endl;
     			i++;
     		}    		
+    		else if ( strcmp( "-l", argv[i] ) == 0 || strcmp( "-levels", argv[i] ) == 0 )
+    		{
+    			if ( i+1 >= argc || !parse_levels( argv[i+1], level_scales ) )
+    			{
+    				std::cout<<"Invalid panorama levels specified, exiting."<<std::endl;
+    				return print_help();
+    			}
+    			i++;
+    		}
+    		else if ( ( strcmp( "-cache", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			cache_path = argv[i+1];
+    			i++;
+    		}
+    		else if ( ( strcmp( "-alloc-check", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			alloc_check_warmup = atoi( argv[i+1] );
+    			display = false;
+    			i++;
+    		}
+    		else if ( strcmp( "-live", argv[i] ) == 0 )
+    			live = true;
+    		else if ( strcmp( "-t", argv[i] ) == 0 || strcmp( "-transpose", argv[i] ) == 0 )
+    			transpose = true;
+    		else if ( strcmp( "-verify-transpose", argv[i] ) == 0 )
+    		{
+    			transpose = verify_transpose = true;
+    			display = false;
+    		}
+    		else if ( ( strcmp( "-static", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			static_threshold = atof( argv[i+1] );
+    			i++;
+    		}
+    		else if ( ( strcmp( "-static-sectors", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			static_sectors = atoi( argv[i+1] );
+    			if ( static_sectors < 1 )
+    			{
+    				std::cout<<"The number of static sectors must be at least 1, exiting."<<std::endl;
+    				return print_help();
+    			}
+    			i++;
+    		}
+    		else if ( ( strcmp( "-track", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			track_path = argv[i+1];
+    			i++;
+    		}
+    		else if ( ( strcmp( "-track-scale", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			track_scale = atof( argv[i+1] );
+    			if ( track_scale <= 0 || track_scale > 1 )
+    			{
+    				std::cout<<"The tracking scale must lie in (0, 1], exiting."<<std::endl;
+    				return print_help();
+    			}
+    			i++;
+    		}
+    		else if ( ( strcmp( "-track-budget", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			track_budget = atof( argv[i+1] );
+    			i++;
+    		}
+    		else if ( ( strcmp( "-track-range", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			track_baseline_focal = atof( argv[i+1] );
+    			i++;
+    		}
+    		else if ( ( strcmp( "-compass", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			compass_path = argv[i+1];
+    			i++;
+    		}
+    		else if ( strcmp( "-compass-subpixel", argv[i] ) == 0 )
+    			compass_subpixel = true;
+    		else if ( ( strcmp( "-geometry", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			if ( !load_mirror_geometry( argv[i+1], geometry ) )
+    			{
+    				std::cout<<"Unable to load the mirror geometry from \""<<argv[i+1]<<"\", exiting."<<std::endl;
+    				return -1;
+    			}
+    			i++;
+    		}
+    		else if ( ( strcmp( "-scale", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			scale = atof( argv[i+1] );
+    			if ( scale <= 0 || scale > 1 )
+    			{
+    				std::cout<<"The panorama scale must lie in (0, 1], exiting."<<std::endl;
+    				return print_help();
+    			}
+    			i++;
+    		}
+    		else if ( strcmp( "-aa", argv[i] ) == 0 )
+    			area = true;
+    		else if ( ( strcmp( "-threads", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			num_threads = std::max( 1, atoi( argv[i+1] ) );
+    			i++;
+    		}
+    		else if ( strcmp( "-v", argv[i] ) == 0 || strcmp( "-verbose", argv[i] ) == 0 )
+    			verbose = true;
+    		else if ( ( strcmp( "-metrics-port", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			metrics_port = atoi( argv[i+1] );
+    			i++;
+    		}
+    		else if ( ( strcmp( "-metrics-file", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			metrics_path = argv[i+1];
+    			i++;
+    		}
+    		else if ( ( strcmp( "-metrics-interval", argv[i] ) == 0 ) && i+1 < argc )
+    		{
+    			metrics_interval = atof( argv[i+1] );
+    			i++;
+    		}
 			else 
 			{
 				std::cout<<"Invalid option \""<<argv[i]<<"\" specified, exiting."<<std::endl;
@@ -90,6 +393,9 @@ int main( int argc, char** argv )
     	}    
     }
 
+	if ( num_threads > 0 )
+		cv::setNumThreads( num_threads );
+
     // Read the pixel values of the lines from the text file and store them in
     // the array y_vals:
     int num_lines = atoi( argv[3] );
@@ -99,6 +405,7 @@ int main( int argc, char** argv )
     int index; 
     float centre_coords[20000][2]; // for now, just hard-code the number of frames
     float x_coord, y_coord;
+    int num_centres = 0;
     
     
     printf("Reading calibration data file... ");
@@ -138,6 +445,8 @@ int main( int argc, char** argv )
 				centre_coords[index][0] = x_coord;
 				centre_coords[index][1] = y_coord;
 				index++;
+				if ( !line.empty() )
+					num_centres = index;
 //				printf("%f, %f\n", x_coord, y_coord);
 			}
 		}
@@ -152,44 +461,194 @@ int main( int argc, char** argv )
 	gettimeofday(&start_time, NULL);
 
 	std::string video_filename = argv[1];
-	
-	printf("Capturing video from '%s'...", argv[1] );
-	cv::VideoCapture capture( video_filename );
-	printf(" done.\n");	
-	
-	// Check if the capture object successfully initialized
-	if ( !capture.isOpened() ) 
+	int radius = geometry.radius();
+	cv::Rect ROI( geometry.offset_x, geometry.offset_y, geometry.width, geometry.width );
+	if ( !geometry.is_default() )
+		printf( "Mirror geometry: %dx%d at (%d, %d).\n", geometry.width, geometry.width, geometry.offset_x, geometry.offset_y );
+
+	if ( track_baseline_focal > 0 && ( !track_path || !transpose ) )
+	{
+		printf( "Track ranges need -track and the transposed images of -transpose, exiting.\n" );
+		return -1;
+	}
+
+	if ( live && cache_path )
 	{
-		printf( "Failed to load video, exiting.\n" );
+		printf( "A frame cache cannot be used with a live source, exiting.\n" );
 		return -1;
 	}
 	
+	// the pool is declared first so that it outlives every buffer taken from it
+	MatPool frame_pool;
+	cv::VideoCapture capture;
+	LiveCapture live_capture;
+	double capture_time = 0;          // when the current live frame was captured
+	// capture-to-output latency of the live frames, in the metrics' buckets
+	long latency_counts[PipelineMetrics::NUM_BUCKETS] = { 0 };
+	long latency_frames = 0;
+	double latency_max = 0;
+	PipelineMetrics metrics;
+	FrameCache cache;
+	cv::Point cache_origin( 0, 0 );
+
+	// the part of the frame the mirror covers in any frame
+	cv::Rect mirror_region = ROI;
+	for ( int i = 0; i < num_centres; i++ )
+		mirror_region = mirror_region | cv::Rect( centre_coords[i][0] - radius, centre_coords[i][1] - radius, geometry.width, geometry.width );
+
+	if ( cache_path )
+	{
+		if ( cache.open( cache_path, video_filename, mirror_region ) )
+			printf("Reading %d frames from cache '%s'.\n", cache.size(), cache_path );
+		else
+		{
+			printf("Decoding '%s' into cache '%s'...", argv[1], cache_path );
+			fflush( stdout );
+			if ( !cache.build( cache_path, video_filename, mirror_region ) || cache.size() == 0 )
+			{
+				printf( " failed, exiting.\n" );
+				return -1;
+			}
+			printf(" done, %d frames in %.3f seconds.\n", cache.size(), cache.decode_seconds() );
+		}
+		cache_origin = cv::Point( cache.region().x, cache.region().y );
+	}
+	else if ( live )
+	{
+		if ( !live_capture.start( video_filename, frame_pool ) )
+		{
+			printf( "Failed to open live source '%s', exiting.\n", argv[1] );
+			return -1;
+		}
+		if ( live_capture.is_simulated() )
+			printf( "Replaying '%s' in real time as a simulated camera.\n", argv[1] );
+		else
+			printf( "Capturing live from camera %s.\n", argv[1] );
+	}
+	else
+	{
+		printf("Capturing video from '%s'...", argv[1] );
+		capture.open( video_filename );
+		printf(" done.\n");	
+		
+		// Check if the capture object successfully initialized
+		if ( !capture.isOpened() ) 
+		{
+			printf( "Failed to load video, exiting.\n" );
+			return -1;
+		}
+	}
+	
 	cv::Mat frame, cropped_img, unwrapped_img, top_img, bottom_img;
 	cv::Mat map_x, map_y;
-	cv::Rect ROI( OFFSET_X, OFFSET_Y, WIDTH, HEIGHT );
+
+	// all of the per-frame buffers come from the pool
+	frame_pool.attach( frame );
+	frame_pool.attach( unwrapped_img );
 	
 	// for now, read the first frame so we can create the map... 
-	capture.read( frame );
-	unwrapped_img.create( RADIUS, (int) 2*PI*RADIUS, frame.type() );
+	if ( cache_path )
+		frame = cache.frame( 0 );
+	else if ( live )
+	{
+		if ( !live_capture.next( frame, capture_time ) )
+		{
+			printf( "Failed to read a frame from the live source, exiting.\n" );
+			return -1;
+		}
+	}
+	else
+		capture.read( frame );
 
-	// create the maps with same size as the cropped image	
-	map_x.create( RADIUS, UNWRAPPED_WIDTH, CV_32FC1 );
-	map_y.create( RADIUS, UNWRAPPED_WIDTH, CV_32FC1 );
+	// the mirror must lie within the frames (the cached region is already
+	// clipped to them)
+	cv::Rect frame_region( cache_origin.x, cache_origin.y, frame.cols, frame.rows );
+	if ( frame.empty() || ( mirror_region & frame_region ) != mirror_region )
+	{
+		printf( "The mirror (%dx%d at (%d, %d)%s) does not fit in the %dx%d frames, exiting.\n",
+				geometry.width, geometry.width, geometry.offset_x, geometry.offset_y,
+				num_centres > 0 ? ", moved by the centres" : "", frame.cols, frame.rows );
+		return -1;
+	}
+	int panorama_rows = radius*scale;
+	int panorama_cols = 2*PI*radius*scale;
+	// transposed output starts from a transposed panorama
+	if ( transpose )
+		unwrapped_img.create( panorama_cols, panorama_rows, frame.type() );
+	else
+		unwrapped_img.create( panorama_rows, panorama_cols, frame.type() );
+	if ( scale != 1 )
+		printf( "Panorama: %dx%d\n", panorama_cols, panorama_rows );
 
-	// develop the map arrays for the unwarping from polar coordinates
-	// i = y coord, j = x coord	
-	int rows = unwrapped_img.rows;
-	int cols = unwrapped_img.cols;
+	// with -aa each pixel averages its footprint on the mirror, otherwise the
+	// maps take a single bilinear sample
+	AreaUnwrapper area_unwrapper;
+	struct timeval maps_start, maps_end;
+	gettimeofday( &maps_start, NULL );
+#ifdef FIXED_GEOMETRY
+	// the maps were generated at build time for the default geometry
+	static_assert( UNWRAP_GEN_WIDTH == WIDTH && UNWRAP_ROWS == RADIUS && UNWRAP_COLS == (int)( 2*PI*RADIUS ),
+				   "unwrap_maps_generated.h is out of date, run make fixed" );
+	bool fixed_maps = geometry.width == WIDTH && scale == 1 && !area;
+	if ( fixed_maps )
+	{
+		map_x = cv::Mat( UNWRAP_ROWS, UNWRAP_COLS, CV_16SC2, (void*) unwrap_map_xy );
+		map_y = cv::Mat( UNWRAP_ROWS, UNWRAP_COLS, CV_16UC1, (void*) unwrap_map_frac );
+	}
+	else
+		printf( "The mirror geometry or panorama differs from the built-in maps, building them now.\n" );
+#endif
+	if ( area )
+		area_unwrapper.setup( polar_radii( panorama_rows, scale ), panorama_cols, 1 / ( radius*scale ), radius, false );
+#ifdef FIXED_GEOMETRY
+	else if ( !fixed_maps )
+#else
+	else
+#endif
+	{
+		// create the maps with same size as the unwrapped image, converted to
+		// fixed-point as for the levels, so remap need not convert them on
+		// every call
+		cv::Mat polar_x, polar_y;
+		build_polar_maps( polar_x, polar_y, polar_radii( panorama_rows, scale ), panorama_cols, 1 / ( radius*scale ), radius, radius );
+		cv::convertMaps( polar_x, polar_y, map_x, map_y, CV_16SC2 );
+	}
+	gettimeofday( &maps_end, NULL );
+	get_time_diff( &time_diff, &maps_start, &maps_end );
+	printf( "Unwrap maps ready in %ld.%06ld seconds.\n", time_diff.tv_sec, time_diff.tv_usec );
 
-	for ( int i = 0; i < rows; i++ )
+	// create the maps for each of the additional panorama levels, converted to
+	// fixed-point for a faster remap
+	int num_levels = level_scales.size();
+	std::vector<cv::Mat> level_map1( num_levels ), level_map2( num_levels ), level_imgs( num_levels );
+	std::vector<AreaUnwrapper> level_unwrappers( num_levels );
+	for ( int k = 0; k < num_levels; k++ )
 	{
-	    for ( int j = 0; j < cols; j++ )
-	    {
-	    	double theta = (double) j / RADIUS;// - (3*PI/2); // discretization in radians
-	    	map_x.at<float>(rows-i,j) = RADIUS + i*sin(theta);
-	    	map_y.at<float>(rows-i,j) = RADIUS + i*cos(theta);
-	    }
-	}	
+		int level_rows = radius*level_scales[k];
+		int level_cols = 2*PI*radius*level_scales[k];
+		double step = 1 / ( radius*level_scales[k] );
+		if ( area )
+			level_unwrappers[k].setup( polar_radii( level_rows, level_scales[k] ), level_cols, step, radius, false );
+		else
+		{
+			cv::Mat level_x, level_y;
+			build_polar_maps( level_x, level_y, polar_radii( level_rows, level_scales[k] ), level_cols, step, radius, radius );
+			cv::convertMaps( level_x, level_y, level_map1[k], level_map2[k], CV_16SC2 );
+		}
+		frame_pool.attach( level_imgs[k] );
+		level_imgs[k].create( level_rows, level_cols, frame.type() );
+		printf( "Panorama level %d: %dx%d\n", k+1, level_cols, level_rows );
+	}
+
+	// the calibration lines are rows of the full resolution panorama
+	for ( int i = 0; i < 2*num_lines; i++ )
+		y_vals[i] = (int)( y_vals[i]*scale + 0.5 );
+	for ( int i = 0; i < 2*num_lines; i++ )
+		if ( ( i % num_lines > 0 && y_vals[i] <= y_vals[i-1] ) || y_vals[i] > panorama_rows )
+		{
+			printf( "The calibration lines do not fit a %d row panorama, exiting.\n", panorama_rows );
+			return -1;
+		}
 
 	// get the top and bottom from the calibration data array:
 	int top_upper = y_vals[0];
@@ -200,11 +659,122 @@ int main( int argc, char** argv )
 	int OUTPUT_HEIGHT = (num_lines-1)*section_height;
 
 	// create the containers for the output stereo images
-	top_img.create( OUTPUT_HEIGHT, UNWRAPPED_WIDTH, frame.type() );
-	bottom_img.create( OUTPUT_HEIGHT, UNWRAPPED_WIDTH, frame.type() );
-	cv::Mat section, resized_section;
+	frame_pool.attach( top_img );
+	frame_pool.attach( bottom_img );
+	if ( transpose )
+	{
+		top_img.create( panorama_cols, OUTPUT_HEIGHT, frame.type() );
+		bottom_img.create( panorama_cols, OUTPUT_HEIGHT, frame.type() );
+	}
+	else
+	{
+		top_img.create( OUTPUT_HEIGHT, panorama_cols, frame.type() );
+		bottom_img.create( OUTPUT_HEIGHT, panorama_cols, frame.type() );
+	}
+
+	// the maps which undistort the panorama's sections into the top and
+	// bottom images
+	cv::Mat section_map1[2], section_map2[2];
+	for ( int b = 0; b < 2; b++ )
+		build_section_maps( y_vals + b*num_lines, num_lines, section_height, panorama_cols, transpose,
+							section_map1[b], section_map2[b] );
+
+	// for transposed output the unwrap maps are transposed, so remap writes
+	// the transposed panorama directly; the untransposed maps remain for the
+	// check
+	cv::Mat transposed_map1, transposed_map2;
+	AreaUnwrapper transposed_unwrapper;
+	cv::Mat check_unwrapped, check_top, check_bottom, check_transposed;
+	cv::Mat check_map1[2], check_map2[2];
+	int transpose_mismatches = 0;
+	double transpose_max_diff = 0;
+
+	// the spans of panorama columns recomputed each frame
+	std::vector<std::pair<int, int> > spans;
+	ChangeDetector detector;
+	std::vector<bool> changed_sectors;
+	long sectors_recomputed = 0, sectors_total = 0;
+	int frames_skipped = 0;
+	if ( static_threshold >= 0 )
+	{
+		frame_pool.attach( detector.current );
+		frame_pool.attach( detector.reference );
+		detector.setup( static_sectors, static_threshold, geometry.width );
+		printf( "Skipping work for %d sectors changing by less than %g grey levels.\n", static_sectors, static_threshold );
+	}
+
+	// the people tracker, which follows the full panorama (or the top image,
+	// which is all there is with transposed output)
+	PeopleTracker tracker;
+	FILE *track_file = NULL;
+	if ( track_path )
+	{
+		track_file = fopen( track_path, "w" );
+		if ( !track_file )
+		{
+			printf( "Unable to open the track file \"%s\" - exiting.\n", track_path );
+			return -1;
+		}
+		fprintf( track_file, "frame,track,bearing_deg,width_deg,elevation,range\n" );
+		tracker.setup( track_scale, track_budget / 1000 );
+	}
+
+	// the visual compass, which follows the same panorama as the tracker
+	VisualCompass compass;
+	FILE *compass_file = NULL;
+	double compass_seconds = 0;
+	int compass_frames = 0;
+	// the confidence of the last estimate, reported again for skipped frames
+	double compass_confidence = 0;
+	if ( compass_path )
+	{
+		compass_file = fopen( compass_path, "w" );
+		if ( !compass_file )
+		{
+			printf( "Unable to open the compass file \"%s\" - exiting.\n", compass_path );
+			return -1;
+		}
+		fprintf( compass_file, "frame,rotation_deg,heading_deg,confidence\n" );
+		compass.subpixel = compass_subpixel;
+	}
+	if ( transpose )
+	{
+		if ( area )
+			transposed_unwrapper.setup( polar_radii( panorama_rows, scale ), panorama_cols, 1 / ( radius*scale ),
+										radius, true );
+		else
+		{
+			cv::transpose( map_x, transposed_map1 );
+			cv::transpose( map_y, transposed_map2 );
+		}
+		if ( verify_transpose )
+		{
+			check_top.create( OUTPUT_HEIGHT, panorama_cols, frame.type() );
+			check_bottom.create( OUTPUT_HEIGHT, panorama_cols, frame.type() );
+			for ( int b = 0; b < 2; b++ )
+				build_section_maps( y_vals + b*num_lines, num_lines, section_height, panorama_cols, false,
+									check_map1[b], check_map2[b] );
+		}
+		printf( "Writing transposed %dx%d top and bottom images.\n", top_img.cols, top_img.rows );
+	}
 
-	resized_section.create( section_height, UNWRAPPED_WIDTH, frame.type() );
+	// the buffers which must stay put in the steady state
+	std::vector<cv::Mat*> frame_buffers;
+	if ( !cache_path && !live )
+		frame_buffers.push_back( &frame );
+	frame_buffers.push_back( &unwrapped_img );
+	frame_buffers.push_back( &top_img );
+	frame_buffers.push_back( &bottom_img );
+	for ( int k = 0; k < num_levels; k++ )
+		frame_buffers.push_back( &level_imgs[k] );
+	std::vector<const uchar*> steady_addresses;
+	size_t steady_heap_allocations = 0;
+	long steady_unwrap_allocations = 0;
+	int alloc_check_failures = 0;
+	int steady_frames = 0;
+	std::vector<long> steady_stage_allocations;
+	if ( heap_allocations() >= 0 )
+		metrics.count_allocations( heap_allocations );
 
 	// video writer does not appear to be working, for now just output a series
 	// of images
@@ -220,10 +790,44 @@ int main( int argc, char** argv )
 //		printf("Failed to initialize video writer, unable to save video!\n");
 //	}
 		
+	if ( metrics_port > 0 || metrics_path )
+	{
+		if ( !metrics.start( metrics_port, metrics_path, metrics_interval ) )
+		{
+			printf( "Failed to listen for metrics on port %d, exiting.\n", metrics_port );
+			return -1;
+		}
+		if ( metrics_port > 0 )
+			printf( "Serving metrics at http://127.0.0.1:%d/metrics\n", metrics_port );
+		if ( metrics_path )
+			printf( "Writing metrics to '%s' every %g seconds.\n", metrics_path, metrics_interval );
+	}
+
 	int frame_num = 1; // the current frame index
+	double read_seconds = 0; // time spent getting frames
 	while(true)
 	{	
-		if ( !capture.read(frame) )
+		double stage_start = live_clock(), frame_start = stage_start, stage_end;
+		struct timeval read_start, read_end;
+		gettimeofday( &read_start, NULL );
+		bool got_frame;
+		if ( cache_path )
+		{
+			got_frame = frame_num < cache.size();
+			if ( got_frame )
+				frame = cache.frame( frame_num );
+		}
+		else if ( live )
+			got_frame = live_capture.next( frame, capture_time );
+		else
+			got_frame = capture.read( frame );
+		gettimeofday( &read_end, NULL );
+		read_seconds += (read_end.tv_sec - read_start.tv_sec) + 1e-6*(read_end.tv_usec - read_start.tv_usec);
+		stage_end = live_clock();
+		metrics.record( PipelineMetrics::READ, stage_end - stage_start );
+		stage_start = stage_end;
+
+		if ( !got_frame )
 		{
 			printf("Failed to read next frame, exiting.\n");
 			break;
@@ -234,64 +838,274 @@ int main( int argc, char** argv )
 		{
 			float x_centre = centre_coords[frame_num][0];
 			float y_centre = centre_coords[frame_num][1];
-			std::cout<<x_centre - RADIUS<<" "<<y_centre - RADIUS<<" "<<WIDTH<<" "<<HEIGHT<<std::endl;
-			cv::Rect tmp(x_centre - RADIUS, y_centre - RADIUS, WIDTH, HEIGHT);
+			cv::Rect tmp(x_centre - radius, y_centre - radius, geometry.width, geometry.width);
 			ROI = tmp;
 			
 		}
-		std::cout<<ROI.x<<" "<<ROI.y<<" "<<ROI.width<<" "<<ROI.height<<std::endl;
-		// select the region of interest in the frame		
-		cropped_img = frame( ROI );		
+		if ( verbose )
+			std::cout<<ROI.x<<" "<<ROI.y<<" "<<ROI.width<<" "<<ROI.height<<std::endl;
+		// select the region of interest in the frame (the cached frames only
+		// hold the mirror region)
+		cropped_img = frame( cv::Rect( ROI.x - cache_origin.x, ROI.y - cache_origin.y, ROI.width, ROI.height ) );
+
+		// find the spans of panorama columns (bearings) to recompute: all of
+		// them, or with change detection only those of the changed sectors
+		spans.clear();
+		if ( static_threshold >= 0 )
+		{
+			sectors_recomputed += detector.update( cropped_img, changed_sectors );
+			sectors_total += detector.sectors();
+			for ( int k = 0; k < detector.sectors(); k++ )
+			{
+				if ( !changed_sectors[k] )
+					continue;
+				int first, last;
+				detector.sector_columns( k, panorama_cols, first, last );
+				if ( !spans.empty() && spans.back().second == first )
+					spans.back().second = last;
+				else
+					spans.push_back( std::make_pair( first, last ) );
+			}
+			if ( spans.empty() )
+			{
+				frames_skipped++;
+				metrics.skipped.fetch_add( 1, std::memory_order_relaxed );
+			}
+		}
+		else
+			spans.push_back( std::make_pair( 0, panorama_cols ) );
+		stage_end = live_clock();
+		metrics.record( PipelineMetrics::DETECT, stage_end - stage_start );
+		stage_start = stage_end;
 			
-		// Remap the image to unwrap it
-	    cv::remap( cropped_img, unwrapped_img, 
-    		 map_x,
-    		 map_y,
-    		 CV_INTER_LINEAR,
-    		 cv::BORDER_CONSTANT,
-    		 cv::Scalar(0,0,0)
-		   );
+		// Remap the image to unwrap it, transposed for transposed output with
+		// the bearings down the rows
+		if ( transpose )
+		{
+			for ( size_t k = 0; k < spans.size(); k++ )
+			{
+				if ( area )
+				{
+					transposed_unwrapper.apply( cropped_img, unwrapped_img, spans[k].first, spans[k].second );
+					continue;
+				}
+				cv::Mat unwrapped_rows = unwrapped_img.rowRange( spans[k].first, spans[k].second );
+				cv::remap( cropped_img, unwrapped_rows,
+						   transposed_map1.rowRange( spans[k].first, spans[k].second ),
+						   transposed_map2.rowRange( spans[k].first, spans[k].second ),
+						   CV_INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0,0,0) );
+			}
+		}
+		else
+		{
+			for ( size_t k = 0; k < spans.size(); k++ )
+			{
+				if ( area )
+				{
+					area_unwrapper.apply( cropped_img, unwrapped_img, spans[k].first, spans[k].second );
+					continue;
+				}
+				cv::Mat unwrapped_cols = unwrapped_img.colRange( spans[k].first, spans[k].second );
+				cv::remap( cropped_img, unwrapped_cols, 
+					 map_x.colRange( spans[k].first, spans[k].second ),
+					 map_y.colRange( spans[k].first, spans[k].second ),
+					 CV_INTER_LINEAR,
+					 cv::BORDER_CONSTANT,
+					 cv::Scalar(0,0,0)
+				   );
+			}
+		}
+		stage_end = live_clock();
+		metrics.record( PipelineMetrics::UNWRAP, stage_end - stage_start );
+		stage_start = stage_end;
 		   
+		// Sample each of the additional levels directly from the mirror
+		for ( int k = 0; k < num_levels; k++ )
+		{
+			for ( size_t n = 0; n < spans.size(); n++ )
+			{
+				// the level's columns covering the span's bearings
+				int first = spans[n].first * level_scales[k] / scale;
+				int last = std::min( (int) ceil( spans[n].second * level_scales[k] / scale ), level_imgs[k].cols );
+				if ( area )
+				{
+					level_unwrappers[k].apply( cropped_img, level_imgs[k], first, last );
+					continue;
+				}
+				cv::Mat level_cols = level_imgs[k].colRange( first, last );
+				cv::remap( cropped_img, level_cols,
+						 level_map1[k].colRange( first, last ),
+						 level_map2[k].colRange( first, last ),
+						 CV_INTER_LINEAR,
+						 cv::BORDER_CONSTANT,
+						 cv::Scalar(0,0,0)
+					   );
+			}
+		}
+		stage_end = live_clock();
+		metrics.record( PipelineMetrics::LEVELS, stage_end - stage_start );
+		stage_start = stage_end;
+
 		// Perform the undistortion as specified by the input file:
-		// Patch together resized image to produce images with uniform angular resolution
-		for ( int i = 0; i<num_lines-1; i++ )
-		{
-			// for the top image...		
-			section = unwrapped_img( cv::Rect( 0, 
-												y_vals[i], 
-												UNWRAPPED_WIDTH, 
-												y_vals[i+1] - y_vals[i] ) );	
-			
-			cv::resize( section, resized_section, resized_section.size() );
-
-			resized_section.copyTo( top_img( cv::Rect( 0, 
-														i*section_height, 
-														UNWRAPPED_WIDTH, 
-														section_height ) ) );
-
-			// and the bottom
-			section = unwrapped_img( cv::Rect( 0, 
-											y_vals[i+num_lines], 
-											UNWRAPPED_WIDTH, 
-											y_vals[i+num_lines+1] - y_vals[i+num_lines] ) );
-
-			cv::resize( section, resized_section, resized_section.size() );
-
-			resized_section.copyTo( bottom_img( cv::Rect( 0, 
-														i*section_height, 
-														UNWRAPPED_WIDTH, 
-														section_height ) ) );
-		}		   
+		// stretch the sections to produce images with uniform angular resolution
+		for ( size_t n = 0; n < spans.size(); n++ )
+			for ( int b = 0; b < 2; b++ )
+				undistort_sections( unwrapped_img, b ? bottom_img : top_img, section_map1[b], section_map2[b],
+									spans[n].first, spans[n].second, transpose );
+		stage_end = live_clock();
+		metrics.record( PipelineMetrics::UNDISTORT, stage_end - stage_start );
+		stage_start = stage_end;
 		
+		// check the recomputed parts of the transposed images against the
+		// transpose of the untransposed pipeline's output
+		if ( verify_transpose && !spans.empty() )
+		{
+			if ( area )
+				area_unwrapper.apply( cropped_img, check_unwrapped );
+			else
+				cv::remap( cropped_img, check_unwrapped, map_x, map_y, CV_INTER_LINEAR,
+						   cv::BORDER_CONSTANT, cv::Scalar(0,0,0) );
+			for ( int b = 0; b < 2; b++ )
+				undistort_sections( check_unwrapped, b ? check_bottom : check_top, check_map1[b], check_map2[b],
+									0, panorama_cols, false );
+			double diff = 0;
+			for ( int b = 0; b < 2; b++ )
+			{
+				cv::transpose( b ? check_bottom : check_top, check_transposed );
+				for ( size_t n = 0; n < spans.size(); n++ )
+					diff = std::max( diff, cv::norm( check_transposed.rowRange( spans[n].first, spans[n].second ),
+													 ( b ? bottom_img : top_img ).rowRange( spans[n].first, spans[n].second ),
+													 cv::NORM_INF ) );
+			}
+			transpose_max_diff = std::max( transpose_max_diff, diff );
+			if ( diff > 1 )
+			{
+				printf( "Frame %d: transposed output differs from cv::transpose by up to %g\n", frame_num, diff );
+				transpose_mismatches++;
+			}
+		}
+
+		if ( track_file )
+		{
+			// a skipped frame is the previous one, so its tracks still stand
+			if ( !spans.empty() )
+				tracker.update( transpose ? top_img : unwrapped_img, transpose, top_img, bottom_img, track_baseline_focal );
+
+			const std::vector<PersonTrack> &tracks = tracker.tracks();
+			for ( size_t t = 0; t < tracks.size(); t++ )
+			{
+				if ( !tracks[t].confirmed() )
+					continue;
+				fprintf( track_file, "%d,%d,%.2f,%.2f,%.3f,", frame_num, tracks[t].id, tracks[t].bearing * 180/PI,
+						 tracks[t].width * 180/PI, tracks[t].elevation );
+				if ( tracks[t].range > 0 )
+					fprintf( track_file, "%.3f", tracks[t].range );
+				fprintf( track_file, "\n" );
+			}
+			stage_end = live_clock();
+			metrics.record( PipelineMetrics::TRACK, stage_end - stage_start );
+			stage_start = stage_end;
+		}
+
+		if ( compass_file )
+		{
+			// nor has a skipped frame rotated
+			double rotation = 0;
+			if ( !spans.empty() )
+				rotation = compass.update( transpose ? top_img : unwrapped_img, transpose, compass_confidence );
+			fprintf( compass_file, "%d,%.3f,%.3f,%.3f\n", frame_num, rotation, compass.heading, compass_confidence );
+			stage_end = live_clock();
+			metrics.record( PipelineMetrics::COMPASS, stage_end - stage_start );
+			if ( !spans.empty() )
+			{
+				compass_seconds += stage_end - stage_start;
+				compass_frames++;
+			}
+			stage_start = stage_end;
+		}
+
+		// the outputs for this frame are ready
+		if ( live )
+		{
+			double latency = live_clock() - capture_time;
+			latency_counts[PipelineMetrics::bucket_of( latency )]++;
+			latency_frames++;
+			latency_max = std::max( latency_max, latency );
+		}
+
+		// once warmed up, no pooled buffer may be reallocated or taken from the
+		// heap, and the unwrapping stages may make no heap allocation at all
+		if ( alloc_check_warmup >= 0 && frame_num >= alloc_check_warmup )
+		{
+			long unwrap_allocations = 0;
+			for ( int s = cache_path ? PipelineMetrics::READ : PipelineMetrics::DETECT; s <= PipelineMetrics::UNDISTORT; s++ )
+				unwrap_allocations += metrics.stage_allocations[s].load( std::memory_order_relaxed );
+			if ( steady_addresses.empty() )
+			{
+				for ( size_t b = 0; b < frame_buffers.size(); b++ )
+					steady_addresses.push_back( frame_buffers[b]->data );
+				steady_heap_allocations = frame_pool.heap_allocations;
+			}
+			else
+			{
+				steady_frames++;
+				bool moved = false;
+				for ( size_t b = 0; b < frame_buffers.size(); b++ )
+					moved = moved || frame_buffers[b]->data != steady_addresses[b];
+				if ( moved || frame_pool.heap_allocations != steady_heap_allocations ||
+					 unwrap_allocations != steady_unwrap_allocations )
+				{
+					printf( "Frame %d: %d pool allocations, %ld heap allocations unwrapping, buffers %s\n", frame_num,
+							(int)( frame_pool.heap_allocations - steady_heap_allocations ),
+							unwrap_allocations - steady_unwrap_allocations, moved ? "moved" : "in place" );
+					steady_heap_allocations = frame_pool.heap_allocations;
+					alloc_check_failures++;
+				}
+			}
+			steady_unwrap_allocations = unwrap_allocations;
+		}
+
 		// display the images and wait
-//		imshow("unwrapped", unwrapped_img);
-		imshow("bottom", bottom_img);
-		imshow("top", top_img);
+		if ( display )
+		{
+//			imshow("unwrapped", unwrapped_img);
+			imshow("bottom", bottom_img);
+			imshow("top", top_img);
+			for ( int k = 0; k < num_levels; k++ )
+			{
+				char name[20];
+				sprintf( name, "level %d", k+1 );
+				imshow( name, level_imgs[k] );
+			}
+		}
 //		imshow("cropped", cropped_img);
 //		imshow("raw", frame);
 		
 		// if we are saving video, write the unwrapped image		
-		if (save)
+		if ( save && spans.empty() && frame_num > 1 )
+		{
+			// nothing changed, so link to the previous frame's images
+			const char *names[2] = { "top", "bottom" };
+			int num_outputs = 2 + num_levels;
+			for ( int k = 0; k < num_outputs; k++ )
+			{
+				char prev[80], next[80];
+				if ( k < 2 )
+				{
+					sprintf( prev, "%s%s_frame_%d.jpg", output_path.c_str(), names[k], frame_num-1 );
+					sprintf( next, "%s%s_frame_%d.jpg", output_path.c_str(), names[k], frame_num );
+				}
+				else
+				{
+					sprintf( prev, "%slevel%d_frame_%d.jpg", output_path.c_str(), k-1, frame_num-1 );
+					sprintf( next, "%slevel%d_frame_%d.jpg", output_path.c_str(), k-1, frame_num );
+				}
+				unlink( next );
+				if ( link( prev, next ) != 0 )
+					imwrite( next, k == 0 ? top_img : k == 1 ? bottom_img : level_imgs[k-2] );
+			}
+		}
+		else if (save)
 		{
 			char buff[50], buff2[50];
 			sprintf( buff, "%stop_frame_%d.jpg", output_path.c_str(), frame_num );
@@ -301,11 +1115,34 @@ int main( int argc, char** argv )
 			sprintf( buff2, "%sbottom_frame_%d.jpg", output_path.c_str(), frame_num );
 			out_name = buff2;
 			imwrite(out_name, bottom_img);
+
+			for ( int k = 0; k < num_levels; k++ )
+			{
+				sprintf( buff, "%slevel%d_frame_%d.jpg", output_path.c_str(), k+1, frame_num );
+				out_name = buff;
+				imwrite(out_name, level_imgs[k]);
+			}
 //			writer << unwrapped_img;
 		}
+		stage_end = live_clock();
+		metrics.record( PipelineMetrics::OUTPUT, stage_end - stage_start );
+		metrics.record( PipelineMetrics::FRAME, stage_end - frame_start );
+		if ( live )
+		{
+			metrics.captured.store( live_capture.captured, std::memory_order_relaxed );
+			metrics.dropped.store( live_capture.dropped, std::memory_order_relaxed );
+			metrics.queue_depth.store( live_capture.pending(), std::memory_order_relaxed );
+		}
+		metrics.pool_bytes.store( frame_pool.heap_bytes, std::memory_order_relaxed );
+		metrics.frame_done();
+		// the heap allocations of the steady state are counted from here
+		if ( !steady_addresses.empty() && steady_stage_allocations.empty() )
+			for ( int s = 0; s < PipelineMetrics::NUM_STAGES; s++ )
+				steady_stage_allocations.push_back( metrics.stage_allocations[s].load( std::memory_order_relaxed ) );
 		frame_num++;
 		
-		char key = cv::waitKey(30);
+		// a live source sets its own pace, so only wait long enough to draw
+		char key = display ? cv::waitKey( live ? 1 : 30 ) : 0;
 		
 		// if ESC is pressed, break
 		if ( key == 27 ) 
@@ -313,7 +1150,81 @@ int main( int argc, char** argv )
 			break;
 		} 			
 	}	
+
+	if ( cache_path )
+	{
+		// frames 0..frame_num-1 would otherwise have been decoded
+		double decode_seconds = cache.decode_seconds() * frame_num / cache.size();
+		printf( "Read %d frames from the cache in %.3f seconds, saving %.3f seconds of decoding.\n",
+				frame_num, read_seconds, decode_seconds - read_seconds );
+	}
+	else
+		printf( "Read %d frames in %.3f seconds.\n", frame_num, read_seconds );
+
+	metrics.stop();
+
+	if ( track_file )
+	{
+		fclose( track_file );
+		tracker.print_report();
+	}
+
+	if ( compass_file )
+	{
+		fclose( compass_file );
+		if ( compass_frames > 0 )
+			printf( "Compass: %d frames at %.3fms each, final heading %.2f degrees.\n", compass_frames,
+					1000 * compass_seconds / compass_frames, compass.heading );
+	}
+
+	if ( static_threshold >= 0 && sectors_total > 0 )
+		printf( "Static scene: %d of %d frames skipped, %.1f%% of sector work skipped.\n", frames_skipped,
+				frame_num - 1, 100.0 * ( sectors_total - sectors_recomputed ) / sectors_total );
+
+	if ( live )
+	{
+		live_capture.stop();
+		print_latency_percentiles( latency_counts, latency_frames, latency_max );
+		printf( "Live source: %ld frames captured, %ld dropped as stale.\n",
+				(long) live_capture.captured, (long) live_capture.dropped );
+	}
+
+	printf( "Buffer pool: %d heap allocations (%.1f MB), %d reuses, %d releases.\n",
+			(int) frame_pool.heap_allocations, frame_pool.heap_bytes / 1048576.0,
+			(int) frame_pool.reuses, (int) frame_pool.releases );
+	if ( verify_transpose )
+	{
+		printf( "Transpose check: %d of %d frames differ from cv::transpose by more than a grey level (largest difference %g).\n",
+				transpose_mismatches, frame_num - 1, transpose_max_diff );
+		if ( transpose_mismatches > 0 )
+			return -1;
+	}
+	if ( alloc_check_warmup >= 0 )
+	{
+		if ( steady_addresses.empty() )
+		{
+			printf( "Allocation check: fewer than %d frames, nothing checked.\n", alloc_check_warmup );
+			return -1;
+		}
+		printf( "Allocation check: %d of %d steady-state frames allocated memory while unwrapping.\n",
+				alloc_check_failures, steady_frames );
+		if ( heap_allocations() < 0 )
+			printf( "Heap allocations are not counted on this platform, only the buffer pool's.\n" );
+		else if ( steady_frames > 0 )
+		{
+			printf( "Heap allocations per steady-state frame:" );
+			for ( int s = 0; s < PipelineMetrics::NUM_STAGES; s++ )
+			{
+				long count = metrics.stage_allocations[s].load( std::memory_order_relaxed ) - steady_stage_allocations[s];
+				if ( count > 0 || s == PipelineMetrics::FRAME )
+					printf( " %s %.1f", PipelineMetrics::stage_name( s ), (double) count / steady_frames );
+			}
+			printf( "\n" );
+		}
+		return alloc_check_failures == 0 ? 0 : -1;
+	}
 	
-	cv::waitKey(0);
+	if ( display )
+		cv::waitKey(0);
 	return 0;
 }
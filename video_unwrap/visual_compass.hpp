@@ -0,0 +1,104 @@
+/*
+*  A visual compass: a rotation of the robot about the mirror axis shifts the
+*  panorama cyclically along the bearing, so the change of heading between
+*  frames is the shift which best aligns their column intensity profiles.
+*
+*  Each frame's profile (the mean of each column) is resampled to a length the
+*  DFT handles quickly, and its spectrum kept. The circular cross-correlation
+*  with the previous profile is then one forward and one inverse DFT,
+*  O(W log W) per frame. The peak can be refined to a fraction of a column by
+*  fitting a parabola through it and its neighbours.
+*/
+
+#ifndef VISUAL_COMPASS_HPP
+#define VISUAL_COMPASS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <math.h>
+
+class VisualCompass
+{
+public:
+	VisualCompass() : heading( 0 ), subpixel( false ), length( 0 ), norm( 0 ) {}
+
+	// Estimate the rotation in degrees since the previous panorama (with the
+	// bearing along the columns, or down the rows if transposed), and add it
+	// to the heading. Positive when the scene moves towards higher bearings.
+	// confidence is the normalised correlation at the peak, in [-1, 1]. The
+	// first panorama gives zero with zero confidence.
+	double update( const cv::Mat &panorama, bool transposed, double &confidence )
+	{
+		// the mean intensity at each bearing
+		if ( panorama.channels() == 3 )
+			cv::cvtColor( panorama, grey, CV_BGR2GRAY );
+		else
+			grey = panorama;
+		cv::reduce( grey, column_means, transposed ? 1 : 0, CV_REDUCE_AVG, CV_32F );
+		if ( transposed )
+			column_means = column_means.reshape( 1, 1 );
+
+		// resample it cyclically to a length with small factors, and remove
+		// the mean so that the correlation follows the structure
+		int cols = column_means.cols;
+		if ( length == 0 )
+			length = cv::getOptimalDFTSize( cols );
+		profile.create( 1, length, CV_32F );
+		float *p = profile.ptr<float>();
+		const float *m = column_means.ptr<float>();
+		for ( int i = 0; i < length; i++ )
+		{
+			double x = (double) i * cols / length;
+			int x0 = (int) x;
+			double f = x - x0;
+			p[i] = (float)( ( 1-f )*m[x0] + f*m[( x0+1 ) % cols] );
+		}
+		cv::subtract( profile, cv::mean( profile ), profile );
+		double current_norm = cv::norm( profile );
+
+		// the spectra are kept in the packed (CCS) format of a real DFT
+		cv::dft( profile, spectrum );
+		confidence = 0;
+		double rotation = 0;
+		if ( !previous.empty() && norm > 0 && current_norm > 0 )
+		{
+			// correlation[s] = sum of previous[n] * current[n+s]
+			cv::mulSpectrums( spectrum, previous, product, 0, true );
+			cv::dft( product, correlation, cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT | cv::DFT_SCALE );
+
+			cv::Point peak;
+			double peak_value;
+			cv::minMaxLoc( correlation, NULL, &peak_value, NULL, &peak );
+			double shift = peak.x;
+			if ( subpixel )
+			{
+				const float *c = correlation.ptr<float>();
+				double left = c[( peak.x + length - 1 ) % length], right = c[( peak.x + 1 ) % length];
+				double curvature = left - 2*peak_value + right;
+				if ( curvature < 0 )
+					shift += 0.5 * ( left - right ) / curvature;
+			}
+			if ( shift > length/2.0 )
+				shift -= length;
+			rotation = shift * 360.0 / length;
+			confidence = peak_value / ( norm * current_norm );
+		}
+		spectrum.copyTo( previous );
+		norm = current_norm;
+
+		heading = fmod( heading + rotation, 360.0 );
+		if ( heading < 0 )
+			heading += 360;
+		return rotation;
+	}
+
+	double heading;           // degrees, relative to the first frame
+	bool subpixel;            // refine the peak to a fraction of a column
+
+private:
+	int length;               // of the resampled profiles
+	double norm;              // of the previous profile
+	cv::Mat grey, column_means, profile, spectrum, previous, product, correlation;
+};
+
+#endif
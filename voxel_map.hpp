@@ -0,0 +1,255 @@
+/*
+*  A rolling, spatially hashed voxel map which accumulates the valid points of
+*  each frame's point cloud (as from reprojectImageTo3D) into a consolidated
+*  local 3D map of bounded size.
+*
+*  Each frame is inserted with the pose of the camera when it was taken: its
+*  position in the map, and its yaw, a rotation about the camera's vertical
+*  (y) axis. The points are moved from the camera's frame into the map's
+*  before they are binned, so the map stays consistent as the robot moves; a
+*  stationary camera can be left at the origin with zero yaw.
+*
+*  Voxels are keyed by their integer grid coordinates at a fixed resolution.
+*  After each frame, voxels further than max_distance from the camera's
+*  position or not seen for max_age frames are evicted, and if the map still holds more
+*  than max_voxels the least recently seen are dropped, so memory stays
+*  constant over long runs.
+*
+*  The map can be saved to and loaded from a compact binary snapshot:
+*
+*    "VOXMAP01", float resolution, uint32 frame, uint64 count,
+*    count x { int32 x, y, z; uint32 hits; uint32 last_seen }
+*/
+
+#ifndef VOXEL_MAP_HPP
+#define VOXEL_MAP_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+struct Voxel
+{
+	uint32_t hits;            // points which have fallen in the voxel
+	uint32_t last_seen;       // frame in which it was last hit
+};
+
+class VoxelMap
+{
+public:
+	VoxelMap( double resolution, size_t max_voxels, double max_distance = 0, unsigned int max_age = 0 )
+		: resolution( resolution ), max_voxels( max_voxels ), max_distance( max_distance ),
+		  max_age( max_age ), frame( 0 )
+	{
+	}
+
+	// Insert the valid points of a CV_32FC3 point cloud, in the frame of a
+	// camera at position with the given yaw (radians, turning its z axis
+	// towards its x axis), ignoring points at or beyond max_z (which
+	// reprojectImageTo3D uses for missing disparities), then evict around the
+	// position. Returns the number of points inserted.
+	size_t insert_frame( const cv::Mat &xyz, const cv::Point3f &position, double yaw, float max_z = 1.0e4f )
+	{
+		frame++;
+		size_t inserted = 0;
+		float c = cos( yaw ), s = sin( yaw );
+		for ( int y = 0; y < xyz.rows; y++ )
+		{
+			const cv::Vec3f *row = xyz.ptr<cv::Vec3f>( y );
+			for ( int x = 0; x < xyz.cols; x++ )
+			{
+				const cv::Vec3f &p = row[x];
+				if ( fabs( p[2] - max_z ) < FLT_EPSILON || fabs( p[2] ) > max_z || p[2] != p[2] )
+					continue;
+				Voxel &v = voxels[key_of( position.x + c*p[0] + s*p[2], position.y + p[1], position.z - s*p[0] + c*p[2] )];
+				v.hits++;
+				v.last_seen = frame;
+				inserted++;
+			}
+		}
+		evict( position );
+		return inserted;
+	}
+
+	// Drop voxels distant from origin and stale voxels, then the least
+	// recently seen until the map fits in max_voxels.
+	void evict( const cv::Point3f &origin )
+	{
+		if ( max_distance > 0 || max_age > 0 )
+		{
+			double max_sq = max_distance*max_distance / (resolution*resolution);
+			double ox = origin.x / resolution, oy = origin.y / resolution, oz = origin.z / resolution;
+			for ( Table::iterator it = voxels.begin(); it != voxels.end(); )
+			{
+				int vx, vy, vz;
+				unpack( it->first, vx, vy, vz );
+				double dx = vx + 0.5 - ox, dy = vy + 0.5 - oy, dz = vz + 0.5 - oz;
+				bool far = max_distance > 0 && dx*dx + dy*dy + dz*dz > max_sq;
+				bool old = max_age > 0 && frame - it->second.last_seen > max_age;
+				if ( far || old )
+					it = voxels.erase( it );
+				else
+					++it;
+			}
+		}
+
+		if ( voxels.size() > max_voxels )
+		{
+			// keep the max_voxels most recently seen
+			std::vector<uint32_t> stamps;
+			stamps.reserve( voxels.size() );
+			for ( Table::iterator it = voxels.begin(); it != voxels.end(); ++it )
+				stamps.push_back( it->second.last_seen );
+			size_t excess = voxels.size() - max_voxels;
+			std::nth_element( stamps.begin(), stamps.begin() + excess, stamps.end() );
+			uint32_t cutoff = stamps[excess];
+
+			// drop everything older than the cutoff, then enough of the voxels
+			// seen at the cutoff
+			for ( Table::iterator it = voxels.begin(); it != voxels.end(); )
+			{
+				if ( it->second.last_seen < cutoff )
+					it = voxels.erase( it );
+				else
+					++it;
+			}
+			for ( Table::iterator it = voxels.begin(); it != voxels.end() && voxels.size() > max_voxels; )
+			{
+				if ( it->second.last_seen == cutoff )
+					it = voxels.erase( it );
+				else
+					++it;
+			}
+		}
+	}
+
+	// true if the voxel containing the point is occupied
+	bool occupied( const cv::Point3f &p, uint32_t min_hits = 1 ) const
+	{
+		Table::const_iterator it = voxels.find( key_of( p.x, p.y, p.z ) );
+		return it != voxels.end() && it->second.hits >= min_hits;
+	}
+
+	// The number of occupied voxels whose centres lie within radius of p.
+	int count_near( const cv::Point3f &p, float radius, uint32_t min_hits = 1 ) const
+	{
+		int r = (int) ceil( radius / resolution );
+		double cx = p.x / resolution, cy = p.y / resolution, cz = p.z / resolution;
+		int bx = (int) floor( cx ), by = (int) floor( cy ), bz = (int) floor( cz );
+		double r_sq = radius*radius / (resolution*resolution);
+		int count = 0;
+		for ( int x = bx - r; x <= bx + r; x++ )
+			for ( int y = by - r; y <= by + r; y++ )
+				for ( int z = bz - r; z <= bz + r; z++ )
+				{
+					double dx = x + 0.5 - cx, dy = y + 0.5 - cy, dz = z + 0.5 - cz;
+					if ( dx*dx + dy*dy + dz*dz > r_sq )
+						continue;
+					Table::const_iterator it = voxels.find( pack( x, y, z ) );
+					if ( it != voxels.end() && it->second.hits >= min_hits )
+						count++;
+				}
+		return count;
+	}
+
+	bool save( const char *filename ) const
+	{
+		FILE *fp = fopen( filename, "wb" );
+		if ( !fp )
+			return false;
+		float res = resolution;
+		uint32_t f = frame;
+		uint64_t count = voxels.size();
+		bool ok = fwrite( "VOXMAP01", 8, 1, fp ) == 1 && fwrite( &res, sizeof(res), 1, fp ) == 1 &&
+			fwrite( &f, sizeof(f), 1, fp ) == 1 && fwrite( &count, sizeof(count), 1, fp ) == 1;
+		for ( Table::const_iterator it = voxels.begin(); ok && it != voxels.end(); ++it )
+		{
+			int32_t record[5];
+			int x, y, z;
+			unpack( it->first, x, y, z );
+			record[0] = x;
+			record[1] = y;
+			record[2] = z;
+			record[3] = it->second.hits;
+			record[4] = it->second.last_seen;
+			ok = fwrite( record, sizeof(record), 1, fp ) == 1;
+		}
+		return fclose( fp ) == 0 && ok;
+	}
+
+	// Load a snapshot saved at the same resolution, replacing the map.
+	bool load( const char *filename )
+	{
+		FILE *fp = fopen( filename, "rb" );
+		if ( !fp )
+			return false;
+		char magic[8];
+		float res;
+		uint32_t f;
+		uint64_t count;
+		bool ok = fread( magic, 8, 1, fp ) == 1 && memcmp( magic, "VOXMAP01", 8 ) == 0 &&
+			fread( &res, sizeof(res), 1, fp ) == 1 && fread( &f, sizeof(f), 1, fp ) == 1 &&
+			fread( &count, sizeof(count), 1, fp ) == 1 && fabs( res - resolution ) < 1e-6*resolution;
+		if ( ok )
+		{
+			// size the table for what is loaded, so that it does not rehash as
+			// it is read back
+			voxels.clear();
+			voxels.reserve( std::min( count, (uint64_t) max_voxels ) );
+			frame = f;
+			for ( uint64_t i = 0; ok && i < count; i++ )
+			{
+				int32_t record[5];
+				ok = fread( record, sizeof(record), 1, fp ) == 1;
+				if ( ok )
+				{
+					Voxel &v = voxels[pack( record[0], record[1], record[2] )];
+					v.hits = record[3];
+					v.last_seen = record[4];
+				}
+			}
+		}
+		fclose( fp );
+		return ok;
+	}
+
+	size_t size() const { return voxels.size(); }
+	unsigned int frames() const { return frame; }
+
+private:
+	typedef std::unordered_map<uint64_t, Voxel> Table;
+
+	// grid coordinates are packed into 21 bits each
+	static uint64_t pack( int x, int y, int z )
+	{
+		const uint64_t mask = ( 1 << 21 ) - 1;
+		return ( (uint64_t) x & mask ) | ( ( (uint64_t) y & mask ) << 21 ) | ( ( (uint64_t) z & mask ) << 42 );
+	}
+
+	static void unpack( uint64_t key, int &x, int &y, int &z )
+	{
+		// shift each field to the top and back to sign-extend it
+		x = (int)( (int64_t)( key << 43 ) >> 43 );
+		y = (int)( (int64_t)( key << 22 ) >> 43 );
+		z = (int)( (int64_t)( key << 1 ) >> 43 );
+	}
+
+	uint64_t key_of( float x, float y, float z ) const
+	{
+		return pack( (int) floor( x / resolution ), (int) floor( y / resolution ), (int) floor( z / resolution ) );
+	}
+
+	double resolution;
+	size_t max_voxels;
+	double max_distance;
+	unsigned int max_age;
+	uint32_t frame;
+	Table voxels;
+};
+
+#endif